@@ -18,7 +18,10 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
-
+#ifdef MM_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -37,6 +40,11 @@
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
+/* Multi-threaded replay (-T) */
+#define SCALE_RUNS      3   /* timed runs per thread count; the best is kept */
+#define PC_RING      4096   /* frees in flight between a producer and its consumer */
+#define RING_DONE ((char *)-1) /* a producer's last entry */
+
 /* weights */
 #define WNONE 0
 #define WALL 1
@@ -92,6 +100,32 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+#ifdef MM_THREADS
+/*
+ * Frees handed from a producer to its consumer in the producer/consumer
+ * replay. One writer and one reader, so head and tail are the only
+ * shared words; they sit on separate cache lines.
+ */
+typedef struct {
+    unsigned long head __attribute__((aligned(64))); /* next slot to read */
+    unsigned long tail __attribute__((aligned(64))); /* next slot to write */
+    char *slot[PC_RING];
+} free_ring_t;
+
+/* What a replay thread does with the trace */
+enum { REPLAY_ALL, REPLAY_PRODUCER, REPLAY_CONSUMER };
+
+/* Per-thread state of a concurrent replay */
+typedef struct {
+    trace_t *trace;
+    char **blocks;             /* this copy's block pointers */
+    free_ring_t *ring;         /* producer/consumer only */
+    int role;
+    int failed;                /* the allocator returned NULL */
+    pthread_barrier_t *start;  /* all threads start the clock together */
+} replay_t;
+#endif
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* set in read_trace */
@@ -178,6 +212,11 @@ static void eval_libc_speed(void *ptr);
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum);
 static void eval_mm_speed(void *ptr);
+#ifdef MM_THREADS
+static double eval_mm_scale(trace_t *trace, int nthreads, int pairs);
+static void run_scaling(int num_tracefiles, const char *tracedir,
+                        char **tracefiles, int max_threads);
+#endif
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
@@ -267,6 +306,7 @@ int main(int argc, char **argv)
 
     int run_libc = 0;     /* If set, run libc malloc (set by -l) */
     int autograder = 0;   /* if set then called by autograder (-A) */
+    int scale_threads = 0;/* if set, replay concurrently on up to this many threads (-T) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput = 0, p1, p2, perfindex;
@@ -280,7 +320,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlD")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:T:hVAlD")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -338,6 +378,16 @@ int main(int argc, char **argv)
             set_timeout = atoi(optarg);
             break;
 
+        case 'T': /* Measure scaling on up to this many threads */
+#ifdef MM_THREADS
+            scale_threads = atoi(optarg);
+            if (scale_threads < 1 || scale_threads > 1024)
+                app_error("-T takes a thread count from 1 to 1024\n");
+#else
+            app_error("-T needs the thread-safe allocator; use mdriver.threads\n");
+#endif
+            break;
+
         case 'h': /* Print this message */
             usage();
             exit(0);
@@ -367,6 +417,16 @@ int main(int argc, char **argv)
         alarm(set_timeout);
     }
 
+    /*
+     * The -T mode replaces the usual single-threaded evaluation
+     */
+    if (scale_threads > 0) {
+#ifdef MM_THREADS
+        run_scaling(num_tracefiles, tracedir, tracefiles, scale_threads);
+#endif
+        exit(errors ? 1 : 0);
+    }
+
     /*
      * Optionally run and evaluate the libc malloc package
      */
@@ -1121,6 +1181,264 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+#ifdef MM_THREADS
+/*
+ * ring_push - Queue a block for the consumer, waiting while the ring is full
+ */
+static void ring_push(free_ring_t *ring, char *p)
+{
+    unsigned long tail = ring->tail;
+
+    while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == PC_RING)
+        sched_yield();
+    ring->slot[tail % PC_RING] = p;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * ring_pop - Take the next block from the producer, waiting while the
+ *    ring is empty
+ */
+static char *ring_pop(free_ring_t *ring)
+{
+    unsigned long head = ring->head;
+    char *p;
+
+    while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head)
+        sched_yield();
+    p = ring->slot[head % PC_RING];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return p;
+}
+
+/*
+ * replay_thread - Replay one copy of a trace. A producer hands its frees
+ *    to its consumer instead of calling mm_free itself; the consumer does
+ *    nothing but free what it is handed.
+ */
+static void *replay_thread(void *vargp)
+{
+    replay_t *r = (replay_t *)vargp;
+    trace_t *trace = r->trace;
+    int i, index;
+    size_t size;
+    char *p;
+
+    pthread_barrier_wait(r->start);
+
+    if (r->role == REPLAY_CONSUMER) {
+        while ((p = ring_pop(r->ring)) != RING_DONE)
+            mm_free(p);
+        return NULL;
+    }
+
+    for (i = 0;  i < trace->num_ops && !r->failed;  i++) {
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            if ((p = mm_malloc(size)) == NULL)
+                r->failed = 1;
+            r->blocks[index] = p;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            if ((p = mm_realloc(r->blocks[index], size)) == NULL && size != 0)
+                r->failed = 1;
+            r->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free, here or on the consumer */
+            p = (index < 0) ? NULL : r->blocks[index];
+            if (r->role == REPLAY_PRODUCER)
+                ring_push(r->ring, p);
+            else
+                mm_free(p);
+            break;
+
+        default:
+            app_error("Nonexistent request type in replay_thread");
+        }
+    }
+
+    if (r->role == REPLAY_PRODUCER)
+        ring_push(r->ring, RING_DONE);
+    return NULL;
+}
+
+/*
+ * eval_mm_scale - Replay the trace on nthreads threads at once, on a
+ *    fresh heap. Each thread (or, with pairs set, each producer/consumer
+ *    pair) replays its own copy. Returns the wall-clock secs of the best
+ *    of SCALE_RUNS runs, or -1 if the heap ran out.
+ */
+static double eval_mm_scale(trace_t *trace, int nthreads, int pairs)
+{
+    int i, run, rc;
+    double secs, best = DBL_MAX;
+    struct timespec t0, t1;
+    pthread_barrier_t start;
+    pthread_t *tids;
+    replay_t *replays;
+    free_ring_t *rings = NULL;
+    char **blocks;
+
+    tids = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    replays = (replay_t *)calloc(nthreads, sizeof(replay_t));
+    blocks = (char **)calloc((size_t)nthreads * trace->num_ids + 1, sizeof(char *));
+    if (pairs && (rings = (free_ring_t *)malloc(nthreads / 2 * sizeof(free_ring_t))) == NULL)
+        unix_error("malloc failed in eval_mm_scale");
+    if (tids == NULL || replays == NULL || blocks == NULL)
+        unix_error("malloc failed in eval_mm_scale");
+
+    for (run = 0; run < SCALE_RUNS && best >= 0; run++) {
+        mem_reset_brk();
+        if (mm_init() < 0)
+            app_error("mm_init failed in eval_mm_scale");
+        memset(blocks, 0, ((size_t)nthreads * trace->num_ids + 1) * sizeof(char *));
+
+        if ((rc = pthread_barrier_init(&start, NULL, nthreads + 1)) != 0) {
+            errno = rc;
+            unix_error("pthread_barrier_init failed in eval_mm_scale");
+        }
+        for (i = 0; i < nthreads; i++) {
+            replays[i].trace = trace;
+            replays[i].blocks = blocks + (size_t)i * trace->num_ids;
+            replays[i].failed = 0;
+            replays[i].start = &start;
+            if (pairs) {
+                replays[i].ring = &rings[i / 2];
+                replays[i].role = (i % 2) ? REPLAY_CONSUMER : REPLAY_PRODUCER;
+                rings[i / 2].head = rings[i / 2].tail = 0;
+            } else {
+                replays[i].ring = NULL;
+                replays[i].role = REPLAY_ALL;
+            }
+            if ((rc = pthread_create(&tids[i], NULL, replay_thread, &replays[i])) != 0) {
+                errno = rc;
+                unix_error("pthread_create failed in eval_mm_scale");
+            }
+        }
+
+        /* Read the clock first: on a busy machine the workers may run to
+           completion before this thread is scheduled again */
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        pthread_barrier_wait(&start);
+        for (i = 0; i < nthreads; i++)
+            pthread_join(tids[i], NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        pthread_barrier_destroy(&start);
+
+        secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        if (secs < best)
+            best = secs;
+        for (i = 0; i < nthreads; i++)
+            if (replays[i].failed)
+                best = -1;
+    }
+
+    free(tids);
+    free(replays);
+    free(blocks);
+    free(rings);
+    return best;
+}
+
+/*
+ * run_scaling - The -T mode. Every valid trace is replayed with 1, 2,
+ *    4, ... up to max_threads threads, first as independent copies and
+ *    then as producer/consumer pairs whose frees cross threads. Prints
+ *    the aggregate throughput per thread count and its scaling
+ *    efficiency, i.e. per-thread throughput relative to the smallest run.
+ *    A trace that exhausts the heap at any thread count is left out of
+ *    the totals so every row covers the same work.
+ */
+static void run_scaling(int num_tracefiles, const char *tracedir,
+                        char **tracefiles, int max_threads)
+{
+    static const char *mode_name[2] = { "independent", "producer/consumer" };
+    int counts[2][32], ncounts[2] = { 0, 0 };
+    double total_secs[2][32], total_ops[2][32];
+    double trace_secs[2][32];
+    double base, kops;
+    int i, m, c, n, ok, used = 0;
+    range_t *ranges = NULL;
+    stats_t stats;
+    trace_t *trace;
+
+    /* Thread counts: powers of two, plus max_threads itself */
+    for (m = 0; m < 2; m++) {
+        for (n = m ? 2 : 1; n < max_threads; n *= 2)
+            counts[m][ncounts[m]++] = n;
+        if (max_threads >= (m ? 2 : 1))
+            counts[m][ncounts[m]++] = m ? max_threads & ~1 : max_threads;
+        if (ncounts[m] > 1 && counts[m][ncounts[m]-1] == counts[m][ncounts[m]-2])
+            ncounts[m]--;
+        for (c = 0; c < ncounts[m]; c++)
+            total_secs[m][c] = total_ops[m][c] = 0;
+    }
+
+    for (i = 0; i < num_tracefiles; i++) {
+        mem_init();
+        trace = read_trace(&stats, tracedir, tracefiles[i]);
+
+        if (!eval_mm_valid(trace, &ranges)) {
+            printf("%s: not valid, skipped\n", trace->filename);
+            free_trace(trace);
+            mem_deinit();
+            continue;
+        }
+
+        ok = 1;
+        for (m = 0; m < 2 && ok; m++)
+            for (c = 0; c < ncounts[m] && ok; c++) {
+                trace_secs[m][c] = eval_mm_scale(trace, counts[m][c], m);
+                if (trace_secs[m][c] < 0) {
+                    printf("%s: heap exhausted with %d threads, left out\n",
+                           trace->filename, counts[m][c]);
+                    ok = 0;
+                } else if (verbose > 1) {
+                    n = m ? counts[m][c] / 2 : counts[m][c];
+                    printf("%-18s %3d %10.6f %8.0f  %s\n", mode_name[m],
+                           counts[m][c], trace_secs[m][c],
+                           n * trace->num_ops / 1e3 / trace_secs[m][c],
+                           trace->filename);
+                }
+            }
+
+        if (ok) {
+            used++;
+            for (m = 0; m < 2; m++)
+                for (c = 0; c < ncounts[m]; c++) {
+                    n = m ? counts[m][c] / 2 : counts[m][c];
+                    total_secs[m][c] += trace_secs[m][c];
+                    total_ops[m][c] += (double)n * trace->num_ops;
+                }
+        }
+
+        free_trace(trace);
+        mem_deinit();
+    }
+
+    printf("\nConcurrent replay of %d traces (best of %d runs):\n",
+           used, SCALE_RUNS);
+    printf("%-18s %7s %10s %9s %9s %5s\n",
+           "mode", "threads", "secs", "Kops", "Kops/thr", "eff");
+    for (m = 0; m < 2; m++) {
+        base = 0;
+        for (c = 0; c < ncounts[m] && used > 0; c++) {
+            kops = total_ops[m][c] / 1e3 / total_secs[m][c];
+            if (c == 0)
+                base = kops / counts[m][c];
+            printf("%-18s %7d %10.6f %9.0f %9.0f %4.0f%%\n", mode_name[m],
+                   counts[m][c], total_secs[m][c], kops, kops / counts[m][c],
+                   100.0 * kops / counts[m][c] / base);
+        }
+    }
+}
+#endif
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1375,7 +1693,7 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
  */
 static void usage(void)
 {
-    fprintf(stderr, "Usage: mdriver [-hlVdD] [-f <file>]\n");
+    fprintf(stderr, "Usage: mdriver [-hlVdD] [-f <file>] [-T <threads>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
@@ -1387,4 +1705,6 @@ static void usage(void)
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-T <n>     Replay traces concurrently on up to n threads and\n"
+                    "\t           report scaling (mdriver.threads only).\n");
 }
@@ -16,6 +16,30 @@
  * memory to the new position. Otherwise, we just use place() to place the new size into old
  * position.
  *
+ * Built with -DMM_THREADS the allocator is thread-safe. The heap is split into MM_ARENAS
+ * arenas, each with its own lock and segregated lists, growing by whole regions of memlib's
+ * heap; threads are spread over the arenas round-robin. In front of its arena every thread
+ * keeps a cache (tcache) of small freed blocks per block size, so most small mallocs and
+ * frees take no lock at all. A block freed by a thread of another arena is pushed on its
+ * owner's lock-free remote-free stack, which the owner drains when it next takes its lock.
+ *
+ * Only free blocks keep a footer. Each header records whether the block before it is
+ * allocated, and whether it is a mini block, so an allocated block's last word is payload
+ * and coalescing still finds a free neighbour before it. Mini blocks are two words, a header
+ * and one word of payload; free ones sit on their own list (class 0), linked forward through
+ * that word. With no room for a footer, a free mini block keeps its back link in its header:
+ * block sizes are even, so an odd size field marks it, and block_size reads it as a mini
+ * block. That lets coalescing unlink a mini neighbour in constant time like any other.
+ *
+ * The last class, blocks of 4096 words and up, is not a list but an AVL tree ordered by size
+ * and then address, so a large request takes the smallest block that fits, found in
+ * O(log n), instead of the first one in a long unsorted list.
+ *
+ * Built with -DMM_TLSF the free lists follow two-level segregated fit (TLSF) instead: each
+ * power-of-two range of sizes is split into SL_COUNT lists, and a bitmap of non-empty lists
+ * per level lets malloc find a list holding a fit with a few bit scans, so malloc and free
+ * take constant time whatever the state of the heap.
+ *
  */
 #include <assert.h>
 #include <stdio.h>
@@ -25,6 +49,10 @@
 #include <unistd.h>
 #include <limits.h>
 #include "contracts.h"
+#ifdef MM_THREADS
+#include <pthread.h>
+#include "config.h"
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -70,27 +98,120 @@ exit(-1);  \
 #define WSIZE		    4
 #define DSIZE		    8
 #define CHUNKSIZE	    (1 << 6)
-#define BLOCKSIZE_MIN	    4
+#define BLOCKSIZE_MIN	    4                   /*Smallest block with room for both links*/
+#define MINI_WORDS          2                   /*A mini block: header and one payload word*/
 #define CLASS_NUMBER        12
 #define MAX(x, y)    ((x) > (y) ? (x) : (y))
 #define MIN(x, y)    ((x) > (y) ? (y) : (x))
 #define PACK(size, alloc)    ((size) | (alloc << 30))
+#define SIZE_MASK           0x1FFFFFFF
+#define ALLOC_BIT           0x40000000
+#define PREV_ALLOC          0x80000000          /*The block before is allocated*/
+#define PREV_MINI           0x20000000          /*The block before is a mini block*/
+#define PREV_BITS           (PREV_ALLOC | PREV_MINI)
+#define MINI_LISTED         0x1                 /*Odd size field: a free mini block's back link*/
 #define CONVERT_32_TO_64(value)    (!(value)? (void *) (NULL) : (void *) (0x800000000 + value))
 #define CONVERT_64_TO_32(value)    (!(value)? 0 : (uint32_t)( (long) value - 0x800000000))
 
+#ifdef MM_TLSF
+#define SL_LOG2             4
+#define SL_COUNT            (1 << SL_LOG2)          /*Second-level lists per power of two*/
+#define FL_COUNT            (30 - SL_LOG2 + 1)      /*Block sizes fit in 30 bits*/
+#define LIST_NUMBER         (FL_COUNT * SL_COUNT)
+#define BITMAP_WORDS        (FL_COUNT + 1)          /*First-level map, then one per level*/
+#else
+#define LIST_NUMBER         CLASS_NUMBER
+#define MINI_CLASS          0                       /*get_class_no(MINI_WORDS)*/
+#define TREE_CLASS          (CLASS_NUMBER - 1)      /*Best-fit tree of large blocks*/
+#endif
+
 typedef uint32_t* block_pointer;
 static block_pointer heap_listp = NULL;
+#ifdef MM_THREADS
+static __thread block_pointer* seg_array;   /*lists of the arena this thread has locked*/
+#ifdef MM_TLSF
+static __thread uint32_t* list_bitmap;
+#endif
+#else
 static block_pointer* seg_array;
+#ifdef MM_TLSF
+/*Too big to take out of the heap, so kept outside it like the arenas' lists*/
+static block_pointer tlsf_lists[LIST_NUMBER];
+static uint32_t tlsf_bitmap[BITMAP_WORDS];
+static uint32_t* list_bitmap;
+#endif
+#endif
+
+/*
+ * Thread-safe mode. Blocks in a tcache stay marked allocated, so they are
+ * not coalesced until they go back to the global lists: when their bin is
+ * full or their thread exits. A bin is a stack linked through the first
+ * payload word of its blocks, which even a mini block has, and holds
+ * blocks of exactly one size.
+ */
+#ifdef MM_THREADS
+#ifndef MM_ARENAS
+#define MM_ARENAS           4
+#endif
+#define ARENA_REGION        (1 << 12)   /*Granularity of region_owner*/
+#define ARENA_MAX_REGIONS   (MAX_HEAP / ARENA_REGION)
+#define TCACHE_MAX_WORDS    64     /*Largest block size cached, in words*/
+#define TCACHE_BINS         ((TCACHE_MAX_WORDS - MINI_WORDS) / 2 + 1)
+#define TCACHE_FILL         16     /*Blocks a bin holds*/
+
+typedef struct tcache {
+    unsigned long generation;      /*heap_generation the blocks belong to*/
+    block_pointer bins[TCACHE_BINS];
+    int counts[TCACHE_BINS];
+} tcache;
+
+/*
+ * An arena owns the regions region_owner maps to it. Blocks never span
+ * two arenas, since every span of regions has its own prologue and
+ * epilogue, so coalescing stays inside the arena. A span that lands right
+ * after the arena's last one is merged into it instead.
+ */
+typedef struct arena {
+    pthread_mutex_t lock;
+    block_pointer seg[LIST_NUMBER];
+#ifdef MM_TLSF
+    uint32_t bitmap[BITMAP_WORDS];
+#endif
+    block_pointer remote;          /*MPSC stack of blocks other threads freed*/
+    block_pointer top;             /*epilogue of the arena's last span*/
+    unsigned char index;
+} arena;
+
+static arena arenas[MM_ARENAS];
+static unsigned char region_owner[ARENA_MAX_REGIONS];
+static pthread_mutex_t sbrk_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int next_arena;
+static __thread arena *thread_arena;
+static __thread arena *locked_arena;
+
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;
+static unsigned long heap_generation;   /*bumped by mm_init, voiding every tcache*/
+static __thread tcache thread_cache;
+
+#define LOCK(a)     arena_lock(a)
+#define UNLOCK(a)   pthread_mutex_unlock(&(a)->lock)
+#else
+#define LOCK(a)
+#define UNLOCK(a)
+#endif
 
 /*Function protitypes for the internal routines*/
 
-static inline void* align(const void const* p, unsigned char w);
-static inline int aligned(const void const* p);
+static inline void* align(const void* p, unsigned char w);
+static inline int aligned(const void* p);
 static int in_heap(const void* p);
 static block_pointer block_next(block_pointer const block);
 static block_pointer block_prev(block_pointer const block);
 static inline int block_free(const block_pointer block);
 static inline void block_mark(block_pointer block, int free);
+static inline int prev_free(const block_pointer block);
+static inline void set_prev_bits(block_pointer block, int alloc, int mini);
 static block_pointer block_mem(block_pointer const block);
 static inline unsigned int block_size(const block_pointer block);
 
@@ -110,33 +231,72 @@ static void add_to_free_list(block_pointer block);
 static block_pointer find_first_fit(size_t size);
 static block_pointer coalesce(block_pointer bp);
 static void delete_block(block_pointer pointer);
+static void mini_remove(block_pointer block);
+static inline void set_mini_prev(block_pointer block, block_pointer prev);
+static inline block_pointer get_mini_prev(block_pointer block);
 static block_pointer combine_block(block_pointer first, block_pointer second);
 void *malloc(size_t size);
 void free(void *ptr);
 static void place(block_pointer bp, size_t size);
 void *realloc(void *oldptr, size_t size);
 void *calloc(size_t nmemb, size_t size);
+static inline int list_index(size_t size);
+#ifdef MM_TLSF
+static inline int tlsf_index(size_t size);
+static block_pointer tlsf_find(size_t size);
+static inline void list_filled(int index);
+static inline void list_emptied(int index);
+#else
 static int get_class_no(size_t size);
+static inline int tree_less(block_pointer a, block_pointer b);
+static inline int tree_height(block_pointer node);
+static inline void tree_update(block_pointer node);
+static block_pointer tree_rotate_left(block_pointer node);
+static block_pointer tree_rotate_right(block_pointer node);
+static block_pointer tree_balance(block_pointer node);
+static block_pointer tree_insert(block_pointer root, block_pointer node);
+static block_pointer tree_remove(block_pointer root, block_pointer node);
+static block_pointer tree_remove_min(block_pointer root, block_pointer* min);
+static block_pointer tree_best_fit(block_pointer root, size_t size);
+static int check_tree(block_pointer root);
+#endif
+static size_t request_words(size_t size);
+static void free_block(block_pointer block);
+#ifdef MM_THREADS
+static int arenas_init(void);
+static arena *arena_current(void);
+static arena *block_arena(block_pointer block);
+static void arena_lock(arena *a);
+static block_pointer arena_extend(size_t words);
+static void remote_push(arena *a, block_pointer block);
+static void remote_drain(arena *a);
+static tcache *tcache_current(void);
+static block_pointer tcache_get(size_t words);
+static int tcache_put(block_pointer block);
+static void tcache_key_init(void);
+static void tcache_flush(void *arg);
+#endif
 
 int mm_checkheap(int verbose);
 static void check_in_heap(block_pointer bp);
 static void checkblock_align(void *bp);
 static void check_header_footer(block_pointer bp);
 static void check_coalescing(block_pointer bp);
-static void check_prev_next_ptr(block_pointer bp);
+static void check_prev_bits(block_pointer prev_block, block_pointer bp);
 int inverse_get_class_no(int class);
 static void check_seg_list(void);
+static block_pointer list_next(block_pointer block);
 
 
 /*Helper Function*/
 /* Align p to a multiple of w bytes */
-static inline void* align(const void const* p, unsigned char w) {
+static inline void* align(const void* p, unsigned char w) {
     return((void *) (((uintptr_t) (p) + (w - 1)) & ~(w - 1)));
 }
 
 
 /* Check if the given pointer is 8-byte aligned */
-static inline int aligned(const void const* p) {
+static inline int aligned(const void* p) {
     return(align(p, 8) == p);
 }
 
@@ -159,10 +319,15 @@ static block_pointer block_next(block_pointer const block) {
 
 /*Get previous block through footer*/
 /*Here we slightly modify the return value to make block_size include header and footer*/
+/*Only a free block has a footer, so the previous block must be free*/
 static block_pointer block_prev(block_pointer const block) {
     REQUIRES(block != NULL);
     REQUIRES(in_heap(block));
+    REQUIRES(prev_free(block));
     
+    if(block[0] & PREV_MINI) {
+        return block - MINI_WORDS;
+    }
     return block - block_size(block - 1);
 }
 
@@ -171,25 +336,44 @@ static inline int block_free(const block_pointer block) {
     REQUIRES(block != NULL);
     REQUIRES(in_heap(block));
     
-    return(!(block[0] & 0x40000000));
+    return(!(block[0] & ALLOC_BIT));
 }
 
+/* Return true if the block before this one is free */
+static inline int prev_free(const block_pointer block) {
+    REQUIRES(block != NULL);
+    REQUIRES(in_heap(block));
+    
+    return(!(block[0] & PREV_ALLOC));
+}
 
-/* Mark the given block as free(1)/alloced(0) by marking the block_header and footer. */
+/* Record in a header what the block before it is */
+static inline void set_prev_bits(block_pointer block, int alloc, int mini) {
+    REQUIRES(block != NULL);
+    REQUIRES(in_heap(block));
+    
+    block[0] = (block[0] & ~PREV_BITS) | (alloc ? PREV_ALLOC : 0) | (mini ? PREV_MINI : 0);
+}
+
+
+/*
+ * Mark the given block as free(1)/alloced(0) by marking the block_header, and the footer
+ * of a free block, then tell the next block about it.
+ */
 static inline void block_mark(block_pointer block, int free) {
     REQUIRES(block != NULL);
     REQUIRES(in_heap(block));
+    REQUIRES(block_size(block) > 0);
     
-    unsigned int next;
     size_t size = block_size(block);
     
-    if (size == 0)
-    next = 0;
-    else
-    next = block_size(block) - 1;
+    block[0] = free ? block[0] & ~ALLOC_BIT : block[0] | ALLOC_BIT;
     
-    block[0] = free ? block[0] & (int) 0xBFFFFFFF : block[0] | 0x40000000;
-    block[next] = block[0];
+    /*A mini block has no room for a footer; it is found through PREV_MINI instead*/
+    if(free && size > MINI_WORDS) {
+        block[size - 1] = size;
+    }
+    set_prev_bits(block + size, !free, size == MINI_WORDS);
 }
 
 /*Return the pointer of the block payload part*/
@@ -205,7 +389,10 @@ static inline unsigned int block_size(const block_pointer block ) {
     REQUIRES( block != NULL );
     REQUIRES( in_heap( block ) );
     
-    return(block[0] & 0x3FFFFFFF);
+    unsigned int size = block[0] & SIZE_MASK;
+    
+    /*A free mini block's size field holds its back link instead*/
+    return (size & MINI_LISTED) ? MINI_WORDS : size;
 }
 
 
@@ -259,8 +446,7 @@ static inline block_pointer block_footer(block_pointer block){
 static inline void set_pred_ptr(block_pointer block, block_pointer pred) {
     REQUIRES(block != NULL);
     REQUIRES(in_heap(block));
-    REQUIRES(pred != NULL);
-    REQUIRES(in_heap(pred));
+    REQUIRES(pred == NULL || in_heap(pred));
     
     *(block + 1) = CONVERT_64_TO_32(pred);
 }
@@ -269,8 +455,7 @@ static inline void set_pred_ptr(block_pointer block, block_pointer pred) {
 static inline void set_succ_ptr(block_pointer block, block_pointer succ) {
     REQUIRES(block != NULL);
     REQUIRES(in_heap(block));
-    REQUIRES(succ != NULL);
-    REQUIRES(in_heap(succ));
+    REQUIRES(succ == NULL || in_heap(succ));
     
     *(block + 2) = CONVERT_64_TO_32(succ);
 }
@@ -291,6 +476,25 @@ static inline block_pointer get_succ_ptr(block_pointer block){
     return CONVERT_32_TO_64(*(block + 2));
 }
 
+/*Set the block before a free mini block on its list, in words, over its size field*/
+static inline void set_mini_prev(block_pointer block, block_pointer prev) {
+    REQUIRES(block != NULL);
+    REQUIRES(in_heap(block));
+    REQUIRES(prev == NULL || in_heap(prev));
+    
+    block[0] = (block[0] & ~SIZE_MASK) | (CONVERT_64_TO_32(prev) / WSIZE) << 1 | MINI_LISTED;
+}
+
+/*Get the block before a free mini block on its list*/
+static inline block_pointer get_mini_prev(block_pointer block) {
+    REQUIRES(block != NULL);
+    REQUIRES(in_heap(block));
+    REQUIRES(block[0] & MINI_LISTED);
+    
+    uint32_t offset = ((block[0] & SIZE_MASK) >> 1) * WSIZE;
+    return CONVERT_32_TO_64(offset);
+}
+
 
 
 
@@ -305,12 +509,21 @@ static inline block_pointer get_succ_ptr(block_pointer block){
  */
 int mm_init(void) {
     
+#ifdef MM_THREADS
+    return arenas_init();
+#else
     block_pointer init_alloc;
     int i;
     
     /*Initialize segregated array */
-    seg_array = (block_pointer*)mem_sbrk(sizeof(block_pointer) * CLASS_NUMBER);
-    for (i = 0; i < CLASS_NUMBER; ++i) {
+#ifdef MM_TLSF
+    seg_array = tlsf_lists;
+    list_bitmap = tlsf_bitmap;
+    memset(list_bitmap, 0, sizeof(tlsf_bitmap));
+#else
+    seg_array = (block_pointer*)mem_sbrk(sizeof(block_pointer) * LIST_NUMBER);
+#endif
+    for (i = 0; i < LIST_NUMBER; ++i) {
         /*Make each item of segregated list as NULL intially*/
         seg_array[i] = NULL;
     }
@@ -324,7 +537,7 @@ int mm_init(void) {
     put(heap_listp, PACK(2, 0));       /*Alignment padding*/
     put(heap_listp + 1, PACK(2, 1));   /*Prologue header*/
     put(heap_listp + 2, PACK(2, 1));   /*Prologue footer*/
-    put(heap_listp + 3, PACK(0, 0));   /*Epilogue header*/
+    put(heap_listp + 3, PACK(0, 1) | PREV_ALLOC);   /*Epilogue header*/
     heap_listp += (2 * 1);
     
     /*Extend the empty heap with free block of CHUNKSIZE bytes*/
@@ -345,11 +558,14 @@ int mm_init(void) {
      */
     add_to_free_list(init_alloc);
     return 0;
+#endif
 }
 
 /*Extends heap with free block and return its block pointer*/
 static block_pointer extend_heap(size_t words) {
-    
+#ifdef MM_THREADS
+    return arena_extend(words);
+#else
     size_t size;
     block_pointer bp, block;
     
@@ -369,6 +585,7 @@ static block_pointer extend_heap(size_t words) {
     put(block_next(block), PACK(0, 1));      /*New epilogue header*/
     
     return block;
+#endif
 }
 
 /*Initialize a block, set block size to its header and footer*/
@@ -378,17 +595,19 @@ int init_block(block_pointer block, size_t size) {
     REQUIRES(in_heap(block));
     block_pointer temp;
     
-    /*Set the size to the header and footer of block*/
-    block[0] = size;
-    temp = block_footer(block);
-    temp[0] = size;
+    /*Set the size to the header, keeping what it says about the block before*/
+    block[0] = size | (block[0] & PREV_BITS);
     
     /* I use explicit free list, thus we need two extra word size to
      * represent pred and suuc. Set next and prev block in the free list to NULL,
-     * and mark them as free.
+     * and mark them as free. A mini block only has room for one link.
      */
     set_pred_ptr(block, (block_pointer)NULL);
-    set_succ_ptr(block, (block_pointer)NULL);
+    if(size > MINI_WORDS) {
+        temp = block_footer(block);
+        temp[0] = size;
+        set_succ_ptr(block, (block_pointer)NULL);
+    }
     block_mark(block, 1);
     
     return 0;
@@ -404,7 +623,7 @@ void add_to_free_list(block_pointer block){
     
     /*According to block size, use get_class_no function to return which class it belongs to.*/
     size = block_size(block);
-    class_no = get_class_no(size);
+    class_no = list_index(size);
     
     if ((init_block(block, size)) != 0) {
         dbg_printf("Error in init_block\n");
@@ -413,9 +632,36 @@ void add_to_free_list(block_pointer block){
     
     block_mark(block, 1);   /*Mark the block as free*/
     
+    /*A mini block links forward through its only free word, and back through its header*/
+    if(size == MINI_WORDS) {
+#ifdef MM_TLSF
+        if(seg_array[class_no] == NULL) {
+            list_filled(class_no);
+        }
+#endif
+        if(seg_array[class_no] != NULL) {
+            set_mini_prev(seg_array[class_no], block);
+        }
+        set_pred_ptr(block, seg_array[class_no]);
+        set_mini_prev(block, NULL);
+        seg_array[class_no] = block;
+        return;
+    }
+    
+#ifndef MM_TLSF
+    /*Large blocks go in the tree*/
+    if(class_no == TREE_CLASS) {
+        seg_array[TREE_CLASS] = tree_insert(seg_array[TREE_CLASS], block);
+        return;
+    }
+#endif
+    
     /*If found free list is NULL, we can directly insert current block.*/
     if(seg_array[class_no] == NULL) {
         seg_array[class_no] = block;
+#ifdef MM_TLSF
+        list_filled(class_no);
+#endif
     }
     
     /*
@@ -432,14 +678,25 @@ void add_to_free_list(block_pointer block){
 
 /*Use first fit algorithm*/
 block_pointer find_first_fit(size_t size) {
+#ifdef MM_TLSF
+    return tlsf_find(size);
+#else
     int class_no;
     block_pointer freelist_head_ptr;
     
     class_no = get_class_no(size);
     
+    /*Any mini block fits a mini request, and none fits a larger one*/
+    if(class_no == MINI_CLASS) {
+        if(seg_array[MINI_CLASS] != NULL) {
+            return seg_array[MINI_CLASS];
+        }
+        class_no++;
+    }
+    
     /*Find the best fit one */
     /*If original class does not find fit one, we search the free list for the next larger size class*/
-    for(int i = class_no; i < CLASS_NUMBER; ++i) {
+    for(int i = class_no; i < TREE_CLASS; ++i) {
         freelist_head_ptr = seg_array[i];
         
         while(freelist_head_ptr) {
@@ -451,7 +708,9 @@ block_pointer find_first_fit(size_t size) {
         }
     }
     
-    return (block_pointer)NULL;
+    /*Only large blocks are left: take the best fit*/
+    return tree_best_fit(seg_array[TREE_CLASS], size);
+#endif
 }
 
 /* Coalesce the memory - We check prev_pointer and next_pointer and classify them into 4 cases*/
@@ -462,21 +721,22 @@ static block_pointer coalesce(block_pointer bp) {
     
     block_pointer prev_pointer, next_pointer, result;
     
-    prev_pointer = block_prev(bp);
+    /*An allocated block before has no footer to find it by, nor a need to*/
+    prev_pointer = prev_free(bp) ? block_prev(bp) : NULL;
     next_pointer = block_next(bp);
     
     result = bp;
     
-    if(!block_free(prev_pointer) && !block_free(next_pointer)) {       /*Case1*/
+    if(!prev_pointer && !block_free(next_pointer)) {                   /*Case1*/
         return result;
     }
     
-    else if(block_free(prev_pointer) && !block_free(next_pointer)) {   /*Case2*/
+    else if(prev_pointer && !block_free(next_pointer)) {               /*Case2*/
         delete_block(prev_pointer);
         result = combine_block(prev_pointer, bp);
     }
     
-    else if(!block_free(prev_pointer) && block_free(next_pointer)){    /*Case3*/
+    else if(!prev_pointer && block_free(next_pointer)){                /*Case3*/
         delete_block(next_pointer);
         result = combine_block(bp, next_pointer);
     }
@@ -503,16 +763,29 @@ void delete_block(block_pointer block) {
     size_t size;
     int class_no;
     
-    block_pointer prev = get_pred_ptr(block);
-    block_pointer next = get_succ_ptr(block);
+    block_pointer prev, next;
     
+    /*A mini block's list is linked differently*/
+    if(block_size(block) == MINI_WORDS) {
+        mini_remove(block);
+    }
+#ifndef MM_TLSF
+    /*A large block is a tree node, not a list element*/
+    else if(list_index(block_size(block)) == TREE_CLASS) {
+        seg_array[TREE_CLASS] = tree_remove(seg_array[TREE_CLASS], block);
+    }
+#endif
     /*If selected block is the head of the free list*/
-    if(prev == NULL) {
+    else if((prev = get_pred_ptr(block)) == NULL) {
+        next = get_succ_ptr(block);
         size = block_size(block);
-        class_no = get_class_no(size);
+        class_no = list_index(size);
         
         if(next == NULL) {
             seg_array[class_no] = NULL;
+#ifdef MM_TLSF
+            list_emptied(class_no);
+#endif
         } else {
             set_pred_ptr(next, NULL);
             seg_array[class_no] = next;
@@ -520,7 +793,8 @@ void delete_block(block_pointer block) {
     }
     
     /*If selected block is not the head of the free list*/
-    else if(prev != NULL) {
+    else {
+        next = get_succ_ptr(block);
         set_succ_ptr(prev, next);
         
         if(next != NULL){
@@ -540,6 +814,35 @@ void delete_block(block_pointer block) {
 }
 
 
+/*
+ * Unlink a free mini block from the mini list, which is linked forward through the pred
+ * word and back through the header. The caller's init_block restores the header's size.
+ */
+static void mini_remove(block_pointer block) {
+    REQUIRES(block != NULL);
+    REQUIRES(block_size(block) == MINI_WORDS);
+    
+    int index = list_index(MINI_WORDS);
+    block_pointer prev, next;
+    
+    prev = get_mini_prev(block);
+    next = get_pred_ptr(block);
+    if(next != NULL) {
+        set_mini_prev(next, prev);
+    }
+    if(prev != NULL) {
+        set_pred_ptr(prev, next);
+        return;
+    }
+    seg_array[index] = next;
+#ifdef MM_TLSF
+    if(next == NULL) {
+        list_emptied(index);
+    }
+#endif
+}
+
+
 /*Combine two blocks, mainly used in coalesce function*/
 static block_pointer combine_block(block_pointer first, block_pointer second){
     
@@ -555,7 +858,7 @@ static block_pointer combine_block(block_pointer first, block_pointer second){
     second_size = block_size(second);
     
     /*Set the new size to the header and footer of the block*/
-    first[0] = first_size + second_size;
+    first[0] = (first[0] & ~SIZE_MASK) | (first_size + second_size);
     temp = block_footer(first);
     temp[0] = first_size + second_size;
     
@@ -577,28 +880,36 @@ void *malloc(size_t size) {
     if(size == 0)
     return NULL;
     
-    /*Adjust block size to include overhead and alignment request*/
-    if(size > BLOCKSIZE_MIN * WSIZE - DSIZE) {
-        word_size = DSIZE * ((size + (DSIZE) + (DSIZE - 1)) / DSIZE);
-    }
-    else {
-        word_size = BLOCKSIZE_MIN * WSIZE;
+    word_size = request_words(size);
+    
+#ifdef MM_THREADS
+    /*A small block this thread freed before needs no lock*/
+    if((bp = tcache_get(word_size)) != NULL) {
+        return block_mem(bp);
     }
-    word_size = (word_size / WSIZE);   /*convert byte size to word size*/
+    
+    /*Take back what other threads freed for us before searching*/
+    arena *a = arena_current();
+    LOCK(a);
+    remote_drain(a);
+#endif
     
     /*Search the free list for a fit*/
     if((bp = find_first_fit(word_size)) != NULL) {
         delete_block(bp);
         place(bp, word_size);
+        UNLOCK(a);
         return block_mem(bp);
     }
     
     /*No fit found. Use extend_heap to get more memory*/
     if((new_alloc = extend_heap(MAX(word_size, CHUNKSIZE))) == NULL) {
+        UNLOCK(a);
         dbg_printf("extend_heap error\n");
-        return (block_pointer)-1;
+        return NULL;
     }
     place(new_alloc, word_size);
+    UNLOCK(a);
     
     //mm_checkheap(1);
     
@@ -610,20 +921,47 @@ void *malloc(size_t size) {
  * Set alloc to free state and insert to free list
  */
 void free(void *ptr) {
-    REQUIRES(ptr != NULL);
-    REQUIRES(in_heap(ptr));
+    REQUIRES(ptr == NULL || in_heap(ptr));
     
     //mm_checkheap(1);
     
+    /*Unlocked: the heap only grows, so a pointer found in it stays there*/
     if(ptr == NULL || !in_heap(ptr)) {
         return ;
     }
     
     block_pointer block = block_header(ptr);
+    
+#ifdef MM_THREADS
+    /*A block of another arena goes back to it without taking its lock*/
+    arena *a = block_arena(block);
+    if(a != arena_current()) {
+        remote_push(a, block);
+        return;
+    }
+    
+    /*Keep small blocks for this thread's next malloc*/
+    if(tcache_put(block)) {
+        return;
+    }
+#endif
+    
+    LOCK(a);
+#ifdef MM_THREADS
+    remote_drain(a);
+#endif
+    free_block(block);
+    UNLOCK(a);
+}
+
+/*Return an allocated block to the free lists, coalesced with its neighbours*/
+static void free_block(block_pointer block) {
+    REQUIRES(block != NULL);
+    REQUIRES(in_heap(block));
+    
     block_mark(block, 1);
     block = coalesce(block);
     add_to_free_list(block);
-    
 }
 
 /**Optionally split the free block, and marked as allocated**/
@@ -631,7 +969,7 @@ static void place(block_pointer bp, size_t alloc_size) {
     REQUIRES(bp != NULL);
     REQUIRES(in_heap(bp));
     size_t total_size;
-    block_pointer temp, next_block;
+    block_pointer next_block;
     
     total_size = block_size(bp);
     
@@ -640,22 +978,19 @@ static void place(block_pointer bp, size_t alloc_size) {
         block_mark(bp, 0);
     }
     else {
-        /*Set size to the header and footer of block*/
-        bp[0] = alloc_size;
-        temp = block_footer(bp);
-        temp[0] = alloc_size;
+        /*Set size to the header; an allocated block has no footer*/
+        bp[0] = (bp[0] & ~SIZE_MASK) | alloc_size;
         
         /*Reminder free blocks are split and initialize to a new free list*/
         next_block = block_next(bp);
+        block_mark(bp, 0);  /*Mark as allocated, which starts the header of the next block*/
         if((init_block(next_block, total_size - alloc_size)) != 0) {
             dbg_printf("Error in init_block\n");
             return;
         }
         
-        block_mark(bp, 0);  /*Mark as allocated*/
-        
-        /*Insert this new splited part to the free list*/
-        add_to_free_list(next_block);
+        /*Insert this new splited part to the free list, merged with any free block after it*/
+        add_to_free_list(coalesce(next_block));
     }
 }
 
@@ -664,24 +999,15 @@ static void place(block_pointer bp, size_t alloc_size) {
 /*
  * Realloc - Naive implementation
  * Compare between old size and new size, if the new size is larger, then we do malloc
- * if the new size is smaller, then we do place.
+ * if the new size is smaller, then we do place. The new block is only allocated when
+ * it is needed, so shrinking in place no longer leaks one.
  */
 void *realloc(void *oldptr, size_t size) {
-    REQUIRES(oldptr != NULL);
-    REQUIRES(in_heap(oldptr));
+    REQUIRES(oldptr == NULL || in_heap(oldptr));
     
     block_pointer block, newptr;
     size_t word_size, old_size;
     
-    /*Adjust requested allocate block size to include overhead and alignment*/
-    if(size > BLOCKSIZE_MIN * WSIZE - DSIZE) {
-        word_size = DSIZE * ((size + (DSIZE) + (DSIZE - 1)) / DSIZE);
-    }
-    else {
-        word_size = BLOCKSIZE_MIN * WSIZE;
-    }
-    word_size = (word_size / WSIZE);   /*convert byte size to word size*/
-    
     /*If size = 0 then this is just free, and we return NULL*/
     if (size == 0) {
         free(oldptr);
@@ -693,31 +1019,30 @@ void *realloc(void *oldptr, size_t size) {
         return(malloc(size));
     }
     
-    /*Use malloc to get new heap space*/
-    newptr = malloc(size);
+    word_size = request_words(size);
+    block = block_header(oldptr);
+    old_size = block_size(block);
+    
+    /*Compare the size between old and new one*/
+    if (old_size >= word_size) {
+#ifdef MM_THREADS
+        arena *a = block_arena(block);
+#endif
+        LOCK(a);
+        place(block, word_size);
+        UNLOCK(a);
+        return oldptr;
+    }
     
-    if (newptr == NULL) {
+    /*Use malloc to get new heap space*/
+    if ((newptr = malloc(size)) == NULL) {
         return NULL;
-        
-    } else {
-        
-        block = block_header(oldptr);
-        old_size = block_size(block);
-        
-        /*Compare the size between old and new one*/
-        if (old_size < word_size) {
-            
-            old_size = old_size * WSIZE;
-            memcpy(newptr, oldptr, MIN(old_size, size));
-            free(oldptr);
-            return newptr;
-            
-        } else {
-            
-            place(block, word_size);
-            return oldptr;
-        }
     }
+    
+    /*Copy the old payload, without its header*/
+    memcpy(newptr, oldptr, MIN(old_size * WSIZE - WSIZE, size));
+    free(oldptr);
+    return newptr;
 }
 
 /*
@@ -736,6 +1061,253 @@ void *calloc( size_t nmemb, size_t size )
     return newptr;
 }
 
+/*Adjust a request to a block size, in words, including the header and alignment*/
+static size_t request_words(size_t size) {
+    size_t word_size;
+    
+    word_size = DSIZE * ((size + (WSIZE) + (DSIZE - 1)) / DSIZE);
+    return word_size / WSIZE;   /*convert byte size to word size*/
+}
+
+#ifdef MM_THREADS
+/*
+ *  Arenas
+ *  ------
+ */
+
+/*Start every arena empty; they take regions from memlib as they need them*/
+static int arenas_init(void) {
+    int i;
+    
+    /*Blocks cached by any thread belong to the heap we are discarding*/
+    heap_generation++;
+    
+    for(i = 0; i < MM_ARENAS; ++i) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+        memset(arenas[i].seg, 0, sizeof(arenas[i].seg));
+#ifdef MM_TLSF
+        memset(arenas[i].bitmap, 0, sizeof(arenas[i].bitmap));
+#endif
+        arenas[i].remote = NULL;
+        arenas[i].top = NULL;
+        arenas[i].index = i;
+    }
+    memset(region_owner, 0, sizeof(region_owner));
+    heap_listp = NULL;
+    return 0;
+}
+
+/*
+ * The arena of the calling thread, assigned round-robin on first use,
+ * which also arranges for the thread's exit to flush its tcache
+ */
+static arena *arena_current(void) {
+    if(thread_arena == NULL) {
+        thread_arena = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % MM_ARENAS];
+        pthread_once(&tcache_once, tcache_key_init);
+        pthread_setspecific(tcache_key, &thread_cache);
+    }
+    return thread_arena;
+}
+
+/*The arena whose region holds block*/
+static arena *block_arena(block_pointer block) {
+    REQUIRES(block != NULL);
+    REQUIRES(in_heap(block));
+    
+    return &arenas[region_owner[((char *)block - (char *)mem_heap_lo()) / ARENA_REGION]];
+}
+
+/*Lock an arena and make its lists the ones the list routines work on*/
+static void arena_lock(arena *a) {
+    pthread_mutex_lock(&a->lock);
+    locked_arena = a;
+    seg_array = a->seg;
+#ifdef MM_TLSF
+    list_bitmap = a->bitmap;
+#endif
+}
+
+/*
+ * Give the locked arena a free block of at least words words. The block is
+ * returned, not yet on a free list, as extend_heap does. When the arena's
+ * last span ends the heap, the heap just grows by words words: the old
+ * epilogue becomes the new block's header, so the arena's blocks stay
+ * packed as in the single-threaded heap. Otherwise a new span starts at the next region boundary, between a
+ * prologue and an epilogue of its own, so no region is shared by arenas.
+ */
+static block_pointer arena_extend(size_t words) {
+    size_t bytes, pad, first, last, i;
+    block_pointer span, block;
+    arena *a = locked_arena;
+    char *brk;
+    int merge;
+    
+    words += words % 2;                /*Keep the heap end aligned*/
+    
+    pthread_mutex_lock(&sbrk_lock);
+    brk = (char *)mem_heap_hi() + 1;
+    merge = (a->top == (block_pointer)brk - 1);
+    if(merge) {
+        pad = 0;
+        bytes = words * WSIZE;
+    }
+    else {
+        /*Padding, prologue and epilogue take four more words*/
+        pad = (ARENA_REGION - (brk - (char *)mem_heap_lo()) % ARENA_REGION) % ARENA_REGION;
+        bytes = (words + 4) * WSIZE;
+    }
+    if((long)(span = mem_sbrk(pad + bytes)) == -1) {
+        pthread_mutex_unlock(&sbrk_lock);
+        dbg_printf("mem_sbrk error\n");
+        return NULL;
+    }
+    span = (block_pointer)((char *)span + pad);
+    first = ((char *)span - (char *)mem_heap_lo()) / ARENA_REGION;
+    last = ((char *)span + bytes - 1 - (char *)mem_heap_lo()) / ARENA_REGION;
+    for(i = first; i <= last; ++i) {
+        region_owner[i] = a->index;
+    }
+    pthread_mutex_unlock(&sbrk_lock);
+    
+    if(merge) {
+        block = a->top;
+        init_block(block, words);
+        a->top = block_next(block);
+        put(a->top, PACK(0, 1));       /*New epilogue header*/
+        return block;
+    }
+    
+    put(span, PACK(2, 0));             /*Alignment padding*/
+    put(span + 1, PACK(2, 1));         /*Prologue header*/
+    put(span + 2, PACK(2, 1));         /*Prologue footer*/
+    block = span + 3;
+    block[0] = PREV_ALLOC;             /*After the prologue*/
+    init_block(block, words);
+    a->top = block_next(block);
+    put(a->top, PACK(0, 1));           /*Epilogue header*/
+    return block;
+}
+
+/*Hand a block to its arena's remote-free stack; lock-free, any thread*/
+static void remote_push(arena *a, block_pointer block) {
+    block_pointer head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+    
+    do {
+        set_pred_ptr(block, head);
+    } while(!__atomic_compare_exchange_n(&a->remote, &head, block, 1,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Free everything on a locked arena's remote-free stack. The owner takes
+ * the whole stack at once, so pushes never race with a pop.
+ */
+static void remote_drain(arena *a) {
+    block_pointer bp, next;
+    
+    if(__atomic_load_n(&a->remote, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+    bp = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+    while(bp != NULL) {
+        next = get_pred_ptr(bp);
+        free_block(bp);
+        bp = next;
+    }
+}
+
+/*
+ *  Thread Cache
+ *  ------------
+ */
+
+/*This thread's tcache, emptied first if mm_init has started a new heap*/
+static tcache *tcache_current(void) {
+    tcache *tc = &thread_cache;
+    
+    if(tc->generation != heap_generation) {
+        memset(tc->bins, 0, sizeof(tc->bins));
+        memset(tc->counts, 0, sizeof(tc->counts));
+        tc->generation = heap_generation;
+    }
+    return tc;
+}
+
+/*Pop a cached block of exactly words words, or NULL*/
+static block_pointer tcache_get(size_t words) {
+    tcache *tc;
+    block_pointer bp;
+    int bin;
+    
+    if(words > TCACHE_MAX_WORDS) {
+        return NULL;
+    }
+    tc = tcache_current();
+    bin = (words - MINI_WORDS) / 2;
+    if((bp = tc->bins[bin]) != NULL) {
+        tc->bins[bin] = get_pred_ptr(bp);
+        tc->counts[bin]--;
+    }
+    return bp;
+}
+
+/*Push an allocated block being freed; return 0 if it must go to the free lists*/
+static int tcache_put(block_pointer block) {
+    REQUIRES(block != NULL);
+    REQUIRES(in_heap(block));
+    
+    tcache *tc;
+    size_t size = block_size(block);
+    int bin;
+    
+    if(size > TCACHE_MAX_WORDS) {
+        return 0;
+    }
+    tc = tcache_current();
+    bin = (size - MINI_WORDS) / 2;
+    if(tc->counts[bin] >= TCACHE_FILL) {
+        return 0;
+    }
+    
+    set_pred_ptr(block, tc->bins[bin]);
+    tc->bins[bin] = block;
+    tc->counts[bin]++;
+    return 1;
+}
+
+static void tcache_key_init(void) {
+    pthread_key_create(&tcache_key, tcache_flush);
+}
+
+/*
+ * Thread exit: give every cached block back to the free lists, along with
+ * what other threads freed to our arena, which might otherwise wait for
+ * a malloc that never comes. A thread that allocates again after this is
+ * given an arena, and an exit flush, anew.
+ */
+static void tcache_flush(void *arg) {
+    tcache *tc = (tcache *)arg;
+    block_pointer bp;
+    int bin;
+    
+    LOCK(thread_arena);
+    remote_drain(thread_arena);
+    if(tc->generation == heap_generation) {
+        for(bin = 0; bin < TCACHE_BINS; ++bin) {
+            while((bp = tc->bins[bin]) != NULL) {
+                tc->bins[bin] = get_pred_ptr(bp);
+                free_block(bp);
+            }
+            tc->counts[bin] = 0;
+        }
+    }
+    UNLOCK(thread_arena);
+    thread_arena = NULL;
+}
+#endif
+
+#ifndef MM_TLSF
 /*Determine which class that the block size belongs to*/
 /*Here we simply use power of 2 to classify different class*/
 int get_class_no(size_t size){
@@ -765,6 +1337,220 @@ int get_class_no(size_t size){
     return 11;
     
 }
+#endif
+
+#ifndef MM_TLSF
+/*
+ *  Large Block Tree
+ *  ----------------
+ *  Free blocks of TREE_CLASS form an AVL tree rooted at seg_array[TREE_CLASS].
+ *  A node keeps its left and right children in the pred and succ words and its
+ *  height in the word after them; every such block has room for all three. The
+ *  tree is ordered by size and then by address, so every key is distinct and a
+ *  given block can always be found again by its key.
+ */
+#define TREE_LEFT(node)     get_pred_ptr(node)
+#define TREE_RIGHT(node)    get_succ_ptr(node)
+
+/*Whether block a comes before block b in the tree*/
+static inline int tree_less(block_pointer a, block_pointer b) {
+    return block_size(a) < block_size(b) || (block_size(a) == block_size(b) && a < b);
+}
+
+static inline int tree_height(block_pointer node) {
+    return node ? (int)node[3] : 0;
+}
+
+static inline void tree_update(block_pointer node) {
+    node[3] = 1 + MAX(tree_height(TREE_LEFT(node)), tree_height(TREE_RIGHT(node)));
+}
+
+static block_pointer tree_rotate_left(block_pointer node) {
+    block_pointer right = TREE_RIGHT(node);
+    
+    set_succ_ptr(node, TREE_LEFT(right));
+    tree_update(node);
+    set_pred_ptr(right, node);
+    tree_update(right);
+    return right;
+}
+
+static block_pointer tree_rotate_right(block_pointer node) {
+    block_pointer left = TREE_LEFT(node);
+    
+    set_pred_ptr(node, TREE_RIGHT(left));
+    tree_update(node);
+    set_succ_ptr(left, node);
+    tree_update(left);
+    return left;
+}
+
+/*Restore the AVL property at node, whose subtrees differ in height by at most 2*/
+static block_pointer tree_balance(block_pointer node) {
+    int diff = tree_height(TREE_LEFT(node)) - tree_height(TREE_RIGHT(node));
+    block_pointer child;
+    
+    if(diff > 1) {
+        child = TREE_LEFT(node);
+        if(tree_height(TREE_LEFT(child)) < tree_height(TREE_RIGHT(child))) {
+            set_pred_ptr(node, tree_rotate_left(child));
+        }
+        return tree_rotate_right(node);
+    }
+    if(diff < -1) {
+        child = TREE_RIGHT(node);
+        if(tree_height(TREE_RIGHT(child)) < tree_height(TREE_LEFT(child))) {
+            set_succ_ptr(node, tree_rotate_right(child));
+        }
+        return tree_rotate_left(node);
+    }
+    tree_update(node);
+    return node;
+}
+
+/*Insert node into the tree at root; return the new root*/
+static block_pointer tree_insert(block_pointer root, block_pointer node) {
+    if(root == NULL) {
+        set_pred_ptr(node, NULL);
+        set_succ_ptr(node, NULL);
+        node[3] = 1;
+        return node;
+    }
+    if(tree_less(node, root)) {
+        set_pred_ptr(root, tree_insert(TREE_LEFT(root), node));
+    } else {
+        set_succ_ptr(root, tree_insert(TREE_RIGHT(root), node));
+    }
+    return tree_balance(root);
+}
+
+/*Unlink the leftmost node of the tree at root into *min; return the new root*/
+static block_pointer tree_remove_min(block_pointer root, block_pointer* min) {
+    if(TREE_LEFT(root) == NULL) {
+        *min = root;
+        return TREE_RIGHT(root);
+    }
+    set_pred_ptr(root, tree_remove_min(TREE_LEFT(root), min));
+    return tree_balance(root);
+}
+
+/*Remove node, which must be in the tree at root; return the new root*/
+static block_pointer tree_remove(block_pointer root, block_pointer node) {
+    block_pointer min, right;
+    
+    if(root == node) {
+        if(TREE_LEFT(root) == NULL) {
+            return TREE_RIGHT(root);
+        }
+        if(TREE_RIGHT(root) == NULL) {
+            return TREE_LEFT(root);
+        }
+        /*Its successor takes its place*/
+        right = tree_remove_min(TREE_RIGHT(root), &min);
+        set_pred_ptr(min, TREE_LEFT(root));
+        set_succ_ptr(min, right);
+        return tree_balance(min);
+    }
+    if(tree_less(node, root)) {
+        set_pred_ptr(root, tree_remove(TREE_LEFT(root), node));
+    } else {
+        set_succ_ptr(root, tree_remove(TREE_RIGHT(root), node));
+    }
+    return tree_balance(root);
+}
+
+/*The smallest block of at least size words, lowest address first, or NULL*/
+static block_pointer tree_best_fit(block_pointer root, size_t size) {
+    block_pointer best = NULL;
+    
+    while(root) {
+        if(block_size(root) >= size) {
+            best = root;
+            root = TREE_LEFT(root);
+        } else {
+            root = TREE_RIGHT(root);
+        }
+    }
+    return best;
+}
+#endif
+
+/*The free list a block of size words goes on*/
+static inline int list_index(size_t size) {
+#ifdef MM_TLSF
+    return tlsf_index(size);
+#else
+    return get_class_no(size);
+#endif
+}
+
+#ifdef MM_TLSF
+/*
+ *  Two-Level Segregated Fit
+ *  ------------------------
+ *  List (fl, sl) holds the sizes whose highest set bit is fl + SL_LOG2 - 1
+ *  and whose next SL_LOG2 bits are sl; sizes below SL_COUNT words have a
+ *  list each at fl 0. Bit fl of list_bitmap[0] is set while any list of
+ *  level fl is non-empty, and bit sl of list_bitmap[1 + fl] while list
+ *  (fl, sl) is.
+ */
+
+/*The list a free block of size words belongs to*/
+static inline int tlsf_index(size_t size) {
+    int fl, sl;
+    
+    if(size < SL_COUNT) {
+        return size;
+    }
+    fl = 31 - __builtin_clz((uint32_t)size);
+    sl = (size >> (fl - SL_LOG2)) ^ SL_COUNT;
+    return (fl - SL_LOG2 + 1) * SL_COUNT + sl;
+}
+
+/*
+ * Find a free block of at least size words without walking a list. Every
+ * block on a list after size's own is big enough, so only the head of its
+ * own list needs a size check.
+ */
+static block_pointer tlsf_find(size_t size) {
+    block_pointer bp;
+    uint32_t map;
+    int index, fl, sl;
+    
+    index = tlsf_index(size);
+    if((bp = seg_array[index]) != NULL && block_size(bp) >= size) {
+        return bp;
+    }
+    
+    /*A larger list on the same level, else the first list of a higher level*/
+    fl = index / SL_COUNT;
+    sl = index % SL_COUNT + 1;
+    map = (sl < SL_COUNT) ? list_bitmap[1 + fl] & (~0U << sl) : 0;
+    if(map == 0) {
+        map = list_bitmap[0] & (~0U << (fl + 1));
+        if(map == 0) {
+            return NULL;
+        }
+        fl = __builtin_ctz(map);
+        map = list_bitmap[1 + fl];
+    }
+    sl = __builtin_ctz(map);
+    return seg_array[fl * SL_COUNT + sl];
+}
+
+/*List index has just got its first block*/
+static inline void list_filled(int index) {
+    list_bitmap[0] |= 1U << (index / SL_COUNT);
+    list_bitmap[1 + index / SL_COUNT] |= 1U << (index % SL_COUNT);
+}
+
+/*List index has just lost its last block*/
+static inline void list_emptied(int index) {
+    if((list_bitmap[1 + index / SL_COUNT] &= ~(1U << (index % SL_COUNT))) == 0) {
+        list_bitmap[0] &= ~(1U << (index / SL_COUNT));
+    }
+}
+#endif
 
 /*Self-definrf debug function*/
 
@@ -772,7 +1558,19 @@ int get_class_no(size_t size){
  * checkheap
  */
 int mm_checkheap(int verbose) {
-    void *bp, *start;
+    block_pointer bp, start, prev;
+    
+#ifdef MM_THREADS
+    /*There is no single heap to walk, only each arena's free lists*/
+    if(verbose) {
+        for(int i = 0; i < MM_ARENAS; ++i) {
+            LOCK(&arenas[i]);
+            check_seg_list();
+            UNLOCK(&arenas[i]);
+        }
+    }
+    return 0;
+#endif
     
     if(verbose) {
         /*Check prologue blocks*/
@@ -787,14 +1585,17 @@ int mm_checkheap(int verbose) {
         
         /*Check each block's address alignment and whether header and footer are the same*/
         /*Check each block whether they falls within heap boundary*/
-        for (start = heap_listp + 1; block_size(bp) > 0; start = block_next(start)) {
+        prev = heap_listp - 1;
+        for (start = heap_listp + 1; block_size(start) > 0; start = block_next(start)) {
             
             check_in_heap(start);
-            checkblock_align(start);
+            checkblock_align(block_mem(start));
             check_header_footer(start);
             check_coalescing(start);
-            check_prev_next_ptr(start);
+            check_prev_bits(prev, start);
+            prev = start;
         }
+        check_prev_bits(prev, bp);
         
         /*Check free block falls within correct bucket of segregate array*/
         check_seg_list();
@@ -810,7 +1611,7 @@ int mm_checkheap(int verbose) {
 static void check_in_heap(block_pointer bp) {
     
     block_pointer prev_pointer, next_pointer;
-    prev_pointer = block_prev(bp);
+    prev_pointer = prev_free(bp) ? block_prev(bp) : NULL;
     next_pointer = block_next(bp);
     
     if (in_heap(bp) != 1)
@@ -826,26 +1627,23 @@ static void checkblock_align(void *bp) {
     printf("Error: %p is not doubleword aligned\n", bp);
 }
 
+/*Only free blocks other than mini blocks have a footer*/
 static void check_header_footer(block_pointer bp) {
-    if (*bp != *block_footer(bp))
+    if (block_free(bp) && block_size(bp) > MINI_WORDS && block_size(bp) != block_size(block_footer(bp)))
     printf("Error: header does not match footer\n");
 }
 
 static void check_coalescing(block_pointer bp) {
-    block_pointer prev_block;
-    prev_block = block_prev(bp);
-    if(block_free(prev_block) && block_free(bp)) {
+    if(prev_free(bp) && block_free(bp)) {
         printf("Error: two consecutive free blocks in the heap\n");
     }
 }
 
-static void check_prev_next_ptr(block_pointer bp) {
-    block_pointer prev_block;
-    prev_block = block_prev(bp);
-    if(get_pred_ptr(bp) == prev_block && get_succ_ptr(prev_block) == bp) {
-        return;
-    } else {
-        printf("Error: next/previous pointers are not consistent\n");
+/*The header of bp must say whether prev_block is allocated, and if free whether it is a mini block*/
+static void check_prev_bits(block_pointer prev_block, block_pointer bp) {
+    if(prev_free(bp) != block_free(prev_block) ||
+       (prev_free(bp) && !(bp[0] & PREV_MINI) != (block_size(prev_block) != MINI_WORDS))) {
+        printf("Error: header of %p is wrong about the block before it\n", (void *)bp);
     }
 }
 
@@ -877,11 +1675,41 @@ int inverse_get_class_no(int class) {
     return INT_MAX;
 }
 
+/*The block after this one on its free list; a mini block links through its pred word*/
+static block_pointer list_next(block_pointer block) {
+    return block_size(block) == MINI_WORDS ? get_pred_ptr(block) : get_succ_ptr(block);
+}
+
 static void check_seg_list(void) {
-    int i, range_max;
-    block_pointer free_list_ptr;
+    int i;
+    block_pointer free_list_ptr, prev = NULL;
     
-    for(i = 0; i < CLASS_NUMBER; ++i) {
+    /*Every free mini block's header must link back to the one before it*/
+    for(free_list_ptr = seg_array[list_index(MINI_WORDS)]; free_list_ptr;
+        free_list_ptr = get_pred_ptr(free_list_ptr)) {
+        if(!(free_list_ptr[0] & MINI_LISTED) || get_mini_prev(free_list_ptr) != prev) {
+            printf("Error: mini block %p has a wrong back link\n", (void *)free_list_ptr);
+        }
+        prev = free_list_ptr;
+    }
+    
+#ifdef MM_TLSF
+    for(i = 0; i < LIST_NUMBER; ++i) {
+        if(!(list_bitmap[1 + i / SL_COUNT] >> (i % SL_COUNT) & 1) != (seg_array[i] == NULL) ||
+           !(list_bitmap[0] >> (i / SL_COUNT) & 1) != (list_bitmap[1 + i / SL_COUNT] == 0)) {
+            printf("Error: bitmap does not match free list %d\n", i);
+        }
+        for(free_list_ptr = seg_array[i]; free_list_ptr; free_list_ptr = list_next(free_list_ptr)) {
+            if(tlsf_index(block_size(free_list_ptr)) != i) {
+                printf("Error: free block fall within wrong bucket size\n");
+            }
+        }
+    }
+#else
+    int range_max;
+    
+    check_tree(seg_array[TREE_CLASS]);
+    for(i = 0; i < TREE_CLASS; ++i) {
         free_list_ptr = seg_array[i];
         range_max = inverse_get_class_no(i);
         
@@ -889,7 +1717,32 @@ static void check_seg_list(void) {
             if(block_size(free_list_ptr) >= (unsigned int) range_max) {
                 printf("Error: free block fall within wrong bucket size\n");
             }
-            free_list_ptr = get_succ_ptr(free_list_ptr);
+            free_list_ptr = list_next(free_list_ptr);
         }
     }
-}
\ No newline at end of file
+#endif
+}
+
+#ifndef MM_TLSF
+/*Check order, heights and balance of the large block tree; return its height*/
+static int check_tree(block_pointer root) {
+    int left, right;
+    
+    if(root == NULL) {
+        return 0;
+    }
+    if(!block_free(root) || list_index(block_size(root)) != TREE_CLASS) {
+        printf("Error: tree node %p is not a large free block\n", (void *)root);
+    }
+    if((TREE_LEFT(root) && !tree_less(TREE_LEFT(root), root)) ||
+       (TREE_RIGHT(root) && !tree_less(root, TREE_RIGHT(root)))) {
+        printf("Error: tree out of order at %p\n", (void *)root);
+    }
+    left = check_tree(TREE_LEFT(root));
+    right = check_tree(TREE_RIGHT(root));
+    if(tree_height(root) != 1 + MAX(left, right) || left - right > 1 || right - left > 1) {
+        printf("Error: tree unbalanced at %p\n", (void *)root);
+    }
+    return 1 + MAX(left, right);
+}
+#endif
@@ -0,0 +1,202 @@
+/*
+ * Name: Chih-Feng Lin
+         Chi-Heng Wu
+ * Andrew ID: chihfenl
+              chihengw
+
+ *
+ * accesslog.c - asynchronous access log. Workers never touch stdio or a
+ *               lock: each thread is bound to one of LOG_RINGS bounded
+ *               lock-free rings (Vyukov's sequence-numbered queue) and
+ *               enqueues a fixed-size record. A single logger thread drains
+ *               the rings, formats the records and writes them with one
+ *               writev() per batch. When a ring is full the record is
+ *               dropped and counted, so memory stays bounded and workers
+ *               never wait for the disk.
+ */
+
+#include <sys/uio.h>
+#include "accesslog.h"
+
+typedef struct log_slot {
+    unsigned long seq;          /* ring position this slot is ready for */
+    access_record rec;
+} log_slot;
+
+typedef struct log_ring {
+    unsigned long head;         /* next position to enqueue */
+    char pad[64 - sizeof(unsigned long)];
+    unsigned long tail;         /* next position to dequeue (logger only) */
+    unsigned long dropped;
+    log_slot slots[LOG_RING_SIZE];
+} log_ring;
+
+static const char *outcome_names[] = {"HIT", "NEG_HIT", "MISS", "PEER", "TUNNEL", "ERROR"};
+
+/*Global variables*/
+static log_ring *rings;
+static int log_fd = -1;
+static unsigned int next_ring;
+static __thread int my_ring = -1;
+
+static int ring_put(log_ring *ring, access_record *rec);
+static int ring_get(log_ring *ring, access_record *rec);
+static void *logger_thread(void *vargp);
+static long elapsed_us(struct timespec *from, struct timespec *to);
+
+/*
+ * access_log_init - Open the log file for appending and start the logger.
+ *                   Returns -1 if the file cannot be opened.
+ */
+int access_log_init(char *path)
+{
+    pthread_t tid;
+    int i, j;
+
+    if((log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, DEF_MODE)) < 0)
+        return -1;
+
+    rings = (log_ring*)Calloc(LOG_RINGS, sizeof(log_ring));
+    for(i = 0; i < LOG_RINGS; i++) {
+        for(j = 0; j < LOG_RING_SIZE; j++) {
+            rings[i].slots[j].seq = j;
+        }
+    }
+
+    Pthread_create(&tid, NULL, logger_thread, NULL);
+    Pthread_detach(tid);
+    return 0;
+}
+
+/*Stamp the arrival time and client of a new request*/
+void access_log_begin(access_record *rec, struct in_addr client)
+{
+    memset(rec, 0, sizeof(*rec));
+    clock_gettime(CLOCK_REALTIME, &rec->start);
+    clock_gettime(CLOCK_MONOTONIC, &rec->clock);
+    rec->client = client;
+    rec->outcome = LOG_ERROR;
+}
+
+/*
+ * access_log - Queue a finished request for the logger. Never blocks; if
+ *              this thread's ring is full the record is counted as dropped.
+ */
+void access_log(access_record *rec)
+{
+    struct timespec now;
+
+    if(log_fd < 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rec->latency_us = elapsed_us(&rec->clock, &now);
+
+    if(my_ring < 0)
+        my_ring = __atomic_fetch_add(&next_ring, 1, __ATOMIC_RELAXED) % LOG_RINGS;
+
+    if(ring_put(&rings[my_ring], rec) < 0)
+        __atomic_fetch_add(&rings[my_ring].dropped, 1, __ATOMIC_RELAXED);
+}
+
+/*Multi-producer enqueue: claim a position with CAS, then publish the slot*/
+static int ring_put(log_ring *ring, access_record *rec)
+{
+    log_slot *slot;
+    unsigned long pos, seq;
+    long diff;
+
+    pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    while(1) {
+        slot = &ring->slots[pos % LOG_RING_SIZE];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        diff = (long)seq - (long)pos;
+
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if(diff < 0) {
+            return -1;      /* ring is full */
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->rec = *rec;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*Single-consumer dequeue, only called by the logger thread*/
+static int ring_get(log_ring *ring, access_record *rec)
+{
+    log_slot *slot = &ring->slots[ring->tail % LOG_RING_SIZE];
+
+    if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring->tail + 1)
+        return -1;      /* empty, or the producer has not published yet */
+
+    *rec = slot->rec;
+    __atomic_store_n(&slot->seq, ring->tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+    ring->tail++;
+    return 0;
+}
+
+/*
+ * logger_thread - Drain the rings round-robin, format up to LOG_BATCH lines
+ *                 and write them with a single writev(). Sleeps briefly
+ *                 whenever the rings are empty.
+ */
+static void *logger_thread(void *vargp)
+{
+    static char lines[LOG_BATCH + 1][LOG_URL_MAX + 128];
+    struct iovec iov[LOG_BATCH + 1];
+    access_record rec;
+    struct timespec idle = {0, LOG_IDLE_USEC * 1000};
+    unsigned long dropped, reported = 0;
+    int i, n, progress;
+
+    while(1) {
+        n = 0;
+        do {
+            progress = 0;
+            for(i = 0; i < LOG_RINGS && n < LOG_BATCH; i++) {
+                if(ring_get(&rings[i], &rec) < 0)
+                    continue;
+                progress = 1;
+                iov[n].iov_base = lines[n];
+                iov[n].iov_len = sprintf(lines[n], "%ld.%03ld %s \"%s\" %d %lu %s %ld\n",
+                        (long)rec.start.tv_sec, rec.start.tv_nsec / 1000000,
+                        inet_ntoa(rec.client), rec.url, rec.status,
+                        (unsigned long)rec.bytes, outcome_names[rec.outcome],
+                        rec.latency_us);
+                n++;
+            }
+        } while(progress && n < LOG_BATCH);
+
+        /*Report records lost since the last batch*/
+        dropped = 0;
+        for(i = 0; i < LOG_RINGS; i++) {
+            dropped += __atomic_load_n(&rings[i].dropped, __ATOMIC_RELAXED);
+        }
+        if(dropped != reported) {
+            iov[n].iov_base = lines[n];
+            iov[n].iov_len = sprintf(lines[n], "# dropped %lu records (%lu total)\n",
+                                     dropped - reported, dropped);
+            reported = dropped;
+            n++;
+        }
+
+        if(n > 0)
+            writev(log_fd, iov, n);
+        if(n < LOG_BATCH)
+            nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+static long elapsed_us(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000L +
+           (to->tv_nsec - from->tv_nsec) / 1000;
+}
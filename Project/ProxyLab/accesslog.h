@@ -0,0 +1,35 @@
+#include "csapp.h"
+
+/* Rings the workers spread over, and records each ring can hold */
+#define LOG_RINGS 16
+#define LOG_RING_SIZE 512
+#define LOG_URL_MAX 200
+/* Records the logger writes per writev(), and how long it naps when idle */
+#define LOG_BATCH 256
+#define LOG_IDLE_USEC 50000
+
+/* How the request was answered, as far as the cache is concerned */
+typedef enum {
+    LOG_HIT,            /* served from the cache */
+    LOG_NEGATIVE_HIT,   /* cached error or connect failure served from the cache */
+    LOG_MISS,           /* fetched from the origin */
+    LOG_PEER,           /* fetched through the peer that owns the URL */
+    LOG_TUNNEL,         /* CONNECT tunnel */
+    LOG_ERROR           /* answered with a proxy error */
+} cache_outcome;
+
+typedef struct access_record {
+    struct timespec start;      /* wall-clock time the request arrived */
+    struct timespec clock;      /* monotonic arrival time, for latency */
+    struct in_addr client;
+    char url[LOG_URL_MAX];
+    int status;
+    size_t bytes;               /* bytes sent to the client */
+    cache_outcome outcome;
+    long latency_us;
+} access_record;
+
+/*Function prototypes*/
+int access_log_init(char *path);
+void access_log_begin(access_record *rec, struct in_addr client);
+void access_log(access_record *rec);
@@ -7,7 +7,12 @@
  *
  * cache.c - we use singly linked list to implement caches and
  *           apply the concept of reader-writer problem to solve
- *           cache memory synchronization issue.
+ *           cache memory synchronization issue. Bodies are stored once
+ *           per distinct content, found through a hash table, and shared
+ *           by reference count between the objects that carry them.
+ *           A reader holds references to the object it found and to its
+ *           body, so neither is freed under it when the object is evicted
+ *           or replaced before the reader is done with it.
  */
 
 #include "cache.h"
@@ -17,6 +22,21 @@ int readcnt;
 unsigned int counter;
 sem_t mutex, w;
 
+static unsigned long long body_hash(const unsigned char *data, size_t size);
+static cache_body *acquire_body(cache_list *cache, unsigned char *data, size_t size,
+                                int compressed, unsigned long long hash);
+static void release_body(cache_list *cache, cache_body *body);
+static void put_body(cache_body *body);
+static void put_elem(cache_elem *cache_ptr);
+static void free_elem(cache_list *cache, cache_elem *cache_ptr);
+static int cmp_candidate(const void *a, const void *b);
+
+/* An object considered by eviction: its recency and share of the cache */
+typedef struct evict_candidate {
+    unsigned int time_stamp;
+    size_t share;
+} evict_candidate;
+
 void initialize_cache()
 {
     readcnt = 0;
@@ -28,6 +48,8 @@ void initialize_cache()
 /*
  * Read the cache list and search whether there exists the same tag cache
  * If found, return the cache pointer. Otherwise, return NULL.
+ * Expired objects are treated as absent. The object found stays valid,
+ * body included, until the caller hands it back with cache_release.
  */
 cache_elem* check_cache_list(cache_list *cache, char *hostname, int *port, char *uri)
 {
@@ -40,11 +62,15 @@ cache_elem* check_cache_list(cache_list *cache, char *hostname, int *port, char
 
     /*Critical section for reader satrts*/
     cache_elem *cache_ptr = cache->head;
+    time_t now = time(NULL);
     counter++;
     while(cache_ptr) {
         if(!strcmp(cache_ptr->hostname, hostname) && (cache_ptr->port == *port) &&
-                !strcmp(cache_ptr->uri, uri)) {
+                !strcmp(cache_ptr->uri, uri) &&
+                (cache_ptr->expires == 0 || cache_ptr->expires > now)) {
             cache_ptr->time_stamp = counter;
+            __atomic_add_fetch(&cache_ptr->refcnt, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&cache_ptr->body->refcnt, 1, __ATOMIC_RELAXED);
             break;
         }
         cache_ptr = cache_ptr->next;
@@ -62,89 +88,471 @@ cache_elem* check_cache_list(cache_list *cache, char *hostname, int *port, char
 }
 
 
-void insert_to_cache(cache_list *cache, char *hostname, int *port, char *uri, 
-                                unsigned char *data , size_t insert_size)
+/*
+ * Insert a response into the cache. The stored object is the response
+ * header immediately followed by the body, ready to be written to a client.
+ * A nonzero expires is the time after which the object is no longer served.
+ * With compress set the body is stored lz-compressed if that saves at least
+ * an eighth of it; such objects must be read back with read_from_cache.
+ */
+void insert_to_cache(cache_list *cache, char *hostname, int *port, char *uri,
+                     char *header, size_t header_size,
+                     unsigned char *body, size_t body_size, time_t expires, int compress)
 {
-    P(&w);
+    size_t stored_body_size = body_size;
+    unsigned char *packed = NULL, *stored;
+    unsigned long long hash;
 
-    /*Critical section for writer satrts*/
+    /*Compress before taking the lock, readers need not wait for it*/
+    if(compress && body_size > 0) {
+        packed = (unsigned char*)Malloc(body_size);
+        stored_body_size = lz_compress(body, body_size, packed, body_size - body_size / 8);
+        if(stored_body_size == 0) {
+            free(packed);
+            packed = NULL;
+            stored_body_size = body_size;
+        }
+    }
+    stored = packed ? packed : body;
+    hash = body_hash(stored, stored_body_size);
 
     /*Create the new cahce element*/
     cache_elem *new_cache = (cache_elem*)Calloc(1, sizeof(cache_elem));
     strcpy(new_cache->hostname, hostname);
     new_cache->port = *port;
     strcpy(new_cache->uri, uri);
-    new_cache->size = insert_size;
+    new_cache->size = header_size + stored_body_size;
+    new_cache->header_size = header_size;
+    new_cache->body_size = body_size;
+    new_cache->compressed = (packed != NULL);
+    new_cache->expires = expires;
+    new_cache->refcnt = 1;
+    new_cache->header = (char*)Malloc(header_size);
+    memcpy(new_cache->header, header, header_size);
+
+    P(&w);
+
+    /*Critical section for writer satrts*/
+
+    /*
+     * Take the body before dropping the older copy, so content that did
+     * not change is kept rather than freed and stored again
+     */
+    new_cache->body = acquire_body(cache, stored, stored_body_size, new_cache->compressed, hash);
     new_cache->time_stamp = counter;
+    cache->total_cache_size += header_size;
 
-    new_cache->data = (unsigned char*)Calloc(1, MAX_OBJECT_SIZE);
-    memcpy(new_cache->data, data, insert_size);
-    cache->total_cache_size += insert_size;
+    /*The new copy replaces any older, possibly expired, one*/
+    remove_from_cache(cache, hostname, port, uri);
 
-    /*If cache space is enough, we can directly insert object to cache*/
-    if(cache->total_cache_size <= MAX_CACHE_SIZE) {
-        new_cache->next = cache->head;
-        cache->head = new_cache;
-        counter++;
-    }
-    /*Otherwise, we need to implement eviction*/
-    else {
+    /*Over the budget, make room for a batch of inserts at once*/
+    if(cache->total_cache_size > cache->budget)
         eviction(cache);
-        new_cache->next = cache->head;
-        cache->head = new_cache;
-        counter++;
-    }
+    new_cache->next = cache->head;
+    cache->head = new_cache;
+    counter++;
 
     /*Critical section for writer ends*/
     V(&w);
+    free(packed);
 }
 
 
-void eviction(cache_list *cache)
+/*
+ * Copy a cached response into buf, decompressing its body if needed. buf
+ * must hold header_size + body_size bytes. Returns the response size, or
+ * -1 if the stored body is corrupt.
+ */
+ssize_t read_from_cache(cache_elem *cache_ptr, unsigned char *buf)
+{
+    ssize_t body_size;
+
+    memcpy(buf, cache_ptr->header, cache_ptr->header_size);
+    if(!cache_ptr->compressed) {
+        memcpy(buf + cache_ptr->header_size, cache_ptr->body->data, cache_ptr->body_size);
+        return cache_ptr->size;
+    }
+    body_size = lz_decompress(cache_ptr->body->data, cache_ptr->body->size,
+                              buf + cache_ptr->header_size, cache_ptr->body_size);
+    if(body_size != (ssize_t)cache_ptr->body_size)
+        return -1;
+    return cache_ptr->header_size + body_size;
+}
+
+
+/*
+ * Hand back an object found by check_cache_list. Needs no lock.
+ */
+void cache_release(cache_elem *cache_ptr)
+{
+    put_body(cache_ptr->body);
+    put_elem(cache_ptr);
+}
+
+
+/*
+ * Write every live object to fd, most recently inserted first, ended by a
+ * record with size 0. The objects are only collected, and held, under the
+ * reader lock; writers are not kept waiting while they go out. Returns -1
+ * if fd failed.
+ */
+int cache_save(cache_list *cache, int fd)
+{
+    cache_elem *cache_ptr, **snapshot;
+    cache_record rec;
+    time_t now = time(NULL);
+    size_t n = 0, i;
+    int rc = 0;
+
+    P(&mutex);
+    readcnt++;
+    if(readcnt == 1) {
+        P(&w);
+    }
+    V(&mutex);
+
+    for(cache_ptr = cache->head; cache_ptr; cache_ptr = cache_ptr->next)
+        n++;
+    snapshot = (cache_elem**)Malloc((n ? n : 1) * sizeof(cache_elem*));
+    n = 0;
+    for(cache_ptr = cache->head; cache_ptr; cache_ptr = cache_ptr->next) {
+        if(cache_ptr->expires != 0 && cache_ptr->expires <= now)
+            continue;
+        __atomic_add_fetch(&cache_ptr->refcnt, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&cache_ptr->body->refcnt, 1, __ATOMIC_RELAXED);
+        snapshot[n++] = cache_ptr;
+    }
+
+    P(&mutex);
+    readcnt--;
+    if(readcnt == 0) {
+        V(&w);
+    }
+    V(&mutex);
+
+    for(i = 0; i < n; i++) {
+        cache_ptr = snapshot[i];
+        memset(&rec, 0, sizeof(rec));
+        rec.time_stamp = cache_ptr->time_stamp;
+        rec.expires = cache_ptr->expires;
+        rec.port = cache_ptr->port;
+        rec.compressed = cache_ptr->compressed;
+        rec.hostname_len = strlen(cache_ptr->hostname);
+        rec.uri_len = strlen(cache_ptr->uri);
+        rec.size = cache_ptr->size;
+        rec.header_size = cache_ptr->header_size;
+        rec.body_size = cache_ptr->body_size;
+        if(rc == 0 && (rio_writen(fd, &rec, sizeof(rec)) < 0 ||
+                rio_writen(fd, cache_ptr->hostname, rec.hostname_len) < 0 ||
+                rio_writen(fd, cache_ptr->uri, rec.uri_len) < 0 ||
+                rio_writen(fd, cache_ptr->header, rec.header_size) < 0 ||
+                rio_writen(fd, cache_ptr->body->data, cache_ptr->body->size) < 0))
+            rc = -1;
+        cache_release(cache_ptr);
+    }
+    free(snapshot);
+
+    memset(&rec, 0, sizeof(rec));
+    if(rc == 0 && rio_writen(fd, &rec, sizeof(rec)) < 0)
+        rc = -1;
+    return rc;
+}
+
+
+/*
+ * Read objects written by cache_save from fd and append them to the cache,
+ * keeping their order and recency, and sharing bodies again as they were
+ * shared before. Objects beyond the budget are dropped. Returns -1 if
+ * the stream ended early or was malformed.
+ */
+int cache_load(cache_list *cache, int fd)
+{
+    cache_elem *new_cache, **tail;
+    cache_record rec;
+    unsigned char *data;
+    int rc = -1;
+
+    P(&w);
+    for(tail = &cache->head; *tail; tail = &(*tail)->next)
+        ;
+
+    while(rio_readn(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+        if(rec.size == 0) {
+            rc = 0;
+            break;
+        }
+        /*read_from_cache unpacks the body into a MAX_OBJECT_SIZE buffer*/
+        if(rec.hostname_len >= MAXLINE || rec.uri_len >= MAXLINE ||
+                rec.size > MAX_OBJECT_SIZE || rec.header_size > rec.size ||
+                rec.body_size > MAX_OBJECT_SIZE - rec.header_size ||
+                (!rec.compressed && rec.body_size != rec.size - rec.header_size))
+            break;
+
+        new_cache = (cache_elem*)Calloc(1, sizeof(cache_elem));
+        data = (unsigned char*)Malloc(rec.size);
+        if(rio_readn(fd, new_cache->hostname, rec.hostname_len) != rec.hostname_len ||
+                rio_readn(fd, new_cache->uri, rec.uri_len) != rec.uri_len ||
+                rio_readn(fd, data, rec.size) != rec.size) {
+            free(data);
+            free(new_cache);
+            break;
+        }
+        if(cache->total_cache_size + rec.size > cache->budget) {
+            free(data);
+            free(new_cache);
+            continue;
+        }
+
+        /*data holds the header, then the stored body*/
+        new_cache->header = (char*)Malloc(rec.header_size);
+        memcpy(new_cache->header, data, rec.header_size);
+        new_cache->body = acquire_body(cache, data + rec.header_size,
+                                       rec.size - rec.header_size, rec.compressed,
+                                       body_hash(data + rec.header_size,
+                                                 rec.size - rec.header_size));
+        free(data);
+
+        new_cache->time_stamp = rec.time_stamp;
+        new_cache->expires = rec.expires;
+        new_cache->refcnt = 1;
+        new_cache->port = rec.port;
+        new_cache->compressed = rec.compressed;
+        new_cache->size = rec.size;
+        new_cache->header_size = rec.header_size;
+        new_cache->body_size = rec.body_size;
+        *tail = new_cache;
+        tail = &new_cache->next;
+        cache->total_cache_size += rec.header_size;
+        if(rec.time_stamp >= counter)
+            counter = rec.time_stamp + 1;
+    }
+    V(&w);
+
+    return rc;
+}
+
+
+/*
+ * Free every object, leaving the cache empty.
+ */
+void cache_clear(cache_list *cache)
 {
     cache_elem *temp;
-    cache_elem *cache_ptr;
-    unsigned int least_recent_time;
-
-    while(cache->total_cache_size > MAX_CACHE_SIZE) {
-        cache_ptr = cache->head;
-        least_recent_time = update_least_time(cache, cache_ptr);
-
-        if(cache->head->time_stamp == least_recent_time) {
-            temp = cache->head;
-            cache->head = cache->head->next;
-            cache->total_cache_size -= cache_ptr->size;
-            free(temp->data);
-            free(temp);
+
+    P(&w);
+    while((temp = cache->head) != NULL) {
+        cache->head = temp->next;
+        free_elem(cache, temp);
+    }
+    V(&w);
+}
+
+
+/*
+ * Change the budget, evicting right away if the cache is now over it.
+ */
+void cache_set_budget(cache_list *cache, size_t budget)
+{
+    P(&w);
+    cache->budget = budget;
+    if(cache->total_cache_size > budget)
+        eviction(cache);
+    V(&w);
+}
+
+
+/*Print the cache's size against its budget; the numbers are not locked*/
+void cache_dump_stats(cache_list *cache, FILE *fp)
+{
+    fprintf(fp, "cache: size=%lu budget=%lu evicted=%lu\n",
+            (unsigned long)cache->total_cache_size, (unsigned long)cache->budget,
+            cache->evicted);
+}
+
+
+/*
+ * Unlink and free every object with the given tag. The caller must hold
+ * the writer lock.
+ */
+void remove_from_cache(cache_list *cache, char *hostname, int *port, char *uri)
+{
+    cache_elem **link = &cache->head;
+    cache_elem *temp;
+
+    while((temp = *link) != NULL) {
+        if(!strcmp(temp->hostname, hostname) && (temp->port == *port) &&
+                !strcmp(temp->uri, uri)) {
+            *link = temp->next;
+            free_elem(cache, temp);
+        } else {
+            link = &temp->next;
         }
+    }
+}
+
 
-        else {
-            while(cache_ptr != NULL) {
-                if(cache_ptr->next->time_stamp == least_recent_time) {
-                    cache->total_cache_size -= cache_ptr->next->size;
-                    temp = cache_ptr->next;
-                    cache_ptr->next = cache_ptr->next->next;
-                    free(temp->data);
-                    free(temp);
-                }
-                cache_ptr = cache_ptr->next;
+/*
+ * Evict least recently used objects until the cache is down to the low
+ * watermark. Instead of a scan of the list per object, one pass collects
+ * each object's stamp and share of the cache; sorted, they give the
+ * newest stamp that has to go, and a second pass unlinks every object up
+ * to it. A shared body only counts in part towards each of its objects,
+ * so this repeats if the estimate fell short. The caller must hold the
+ * writer lock.
+ */
+void eviction(cache_list *cache)
+{
+    size_t target = cache->budget / 100 * CACHE_LOW_WATERMARK;
+    size_t n, i, need, freed;
+    evict_candidate *candidates;
+    cache_elem **link, *temp;
+    unsigned int cutoff;
+
+    while(cache->total_cache_size > target && cache->head != NULL) {
+        n = 0;
+        for(temp = cache->head; temp; temp = temp->next)
+            n++;
+        candidates = (evict_candidate*)Malloc(n * sizeof(evict_candidate));
+        for(i = 0, temp = cache->head; temp; i++, temp = temp->next) {
+            candidates[i].time_stamp = temp->time_stamp;
+            candidates[i].share = temp->header_size + temp->body->size / temp->body->objects;
+        }
+        qsort(candidates, n, sizeof(evict_candidate), cmp_candidate);
+
+        /*Oldest first, until enough would be freed*/
+        need = cache->total_cache_size - target;
+        freed = 0;
+        for(i = 0; i < n - 1; i++) {
+            freed += candidates[i].share;
+            if(freed >= need)
+                break;
+        }
+        cutoff = candidates[i].time_stamp;
+        free(candidates);
+
+        link = &cache->head;
+        while((temp = *link) != NULL) {
+            if(temp->time_stamp <= cutoff) {
+                *link = temp->next;
+                free_elem(cache, temp);
+                cache->evicted++;
+            } else {
+                link = &temp->next;
             }
         }
     }
 }
 
 
-unsigned int update_least_time(cache_list *cache, cache_elem* cache_ptr)
+static int cmp_candidate(const void *a, const void *b)
 {
-    //cache_elem *cache_ptr = cache->head;
-    unsigned int least_recent_time = cache->head->time_stamp;
+    unsigned int x = ((const evict_candidate*)a)->time_stamp;
+    unsigned int y = ((const evict_candidate*)b)->time_stamp;
+    return (x > y) - (x < y);
+}
 
-    /*Traverse to find the least used cache and set least_recent_time*/
-    while(cache_ptr) {
-        if(cache_ptr->time_stamp < least_recent_time)
-            least_recent_time = cache_ptr->time_stamp;
-        cache_ptr = cache_ptr->next;
+
+/*
+ * Hash a stored body eight bytes at a time. Equal hashes are confirmed
+ * with memcmp, so this only has to spread bodies over the buckets.
+ */
+static unsigned long long body_hash(const unsigned char *data, size_t size)
+{
+    unsigned long long h = 0x9e3779b97f4a7c15ULL ^ size, k;
+    size_t i;
+
+    for(i = 0; i + 8 <= size; i += 8) {
+        memcpy(&k, data + i, 8);
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 32;
+        h = (h ^ k) * 0xc4ceb9fe1a85ec53ULL;
+    }
+    k = 0;
+    memcpy(&k, data + i, size - i);
+    h = (h ^ k) * 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 29);
+}
+
+
+/*
+ * Return a reference to the stored body with these bytes, adding one if
+ * none has them yet; only a new body counts against the cache size. The
+ * caller must hold the writer lock.
+ */
+static cache_body *acquire_body(cache_list *cache, unsigned char *data, size_t size,
+                                int compressed, unsigned long long hash)
+{
+    cache_body **bucket = &cache->bodies[hash % CACHE_BODY_BUCKETS];
+    cache_body *body;
+
+    for(body = *bucket; body; body = body->next) {
+        if(body->hash == hash && body->size == size && body->compressed == compressed &&
+                !memcmp(body->data, data, size)) {
+            body->objects++;
+            __atomic_add_fetch(&body->refcnt, 1, __ATOMIC_RELAXED);
+            return body;
+        }
+    }
+
+    body = (cache_body*)Malloc(sizeof(cache_body) + size);
+    body->hash = hash;
+    body->size = size;
+    body->compressed = compressed;
+    body->objects = 1;
+    body->refcnt = 1;
+    memcpy(body->data, data, size);
+    body->next = *bucket;
+    *bucket = body;
+    cache->total_cache_size += size;
+    return body;
+}
+
+
+/*
+ * Drop an object's reference to a stored body. With the last object the
+ * body leaves the cache, and memory too unless a reader still holds it.
+ * The caller must hold the writer lock.
+ */
+static void release_body(cache_list *cache, cache_body *body)
+{
+    cache_body **link;
+
+    if(--body->objects == 0) {
+        for(link = &cache->bodies[body->hash % CACHE_BODY_BUCKETS]; *link != body;
+                link = &(*link)->next)
+            ;
+        *link = body->next;
+        cache->total_cache_size -= body->size;
     }
-    return least_recent_time;
+    put_body(body);
 }
 
+
+/*Drop a reference to a stored body, freeing it with the last one*/
+static void put_body(cache_body *body)
+{
+    if(__atomic_sub_fetch(&body->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        free(body);
+}
+
+
+/*Drop a reference to an object, freeing it with the last one*/
+static void put_elem(cache_elem *cache_ptr)
+{
+    if(__atomic_sub_fetch(&cache_ptr->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(cache_ptr->header);
+        free(cache_ptr);
+    }
+}
+
+
+/*
+ * Take an object already unlinked from the list out of the cache, with its
+ * share of the body; it is freed once no reader holds it
+ */
+static void free_elem(cache_list *cache, cache_elem *cache_ptr)
+{
+    cache->total_cache_size -= cache_ptr->header_size;
+    release_body(cache, cache_ptr->body);
+    put_elem(cache_ptr);
+}
@@ -1,30 +1,83 @@
 #include "csapp.h"
+#include "lz.h"
 
-#define MAX_CACHE_SIZE 1049000
+/* Budget of a cache nobody sized; see cache_set_budget */
+#define DEFAULT_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* Percent of the budget that eviction brings the cache back down to */
+#define CACHE_LOW_WATERMARK 90
+
+/* Hash buckets of the table that finds a stored body by its content */
+#define CACHE_BODY_BUCKETS 256
+
+
+/*
+ * A stored body. Objects with byte-identical stored bodies share one,
+ * so it is counted against the cache budget only once. It leaves the
+ * cache with its last object, and memory with its last reference.
+ */
+typedef struct cache_body {
+    unsigned long long hash; /* of the stored bytes */
+    size_t size;             /* bytes held in data */
+    int compressed;
+    int objects;             /* cached objects pointing here */
+    int refcnt;              /* those objects plus readers holding it */
+    struct cache_body *next; /* in its hash bucket */
+    unsigned char data[];
+} cache_body;
 
 typedef struct cache_elem {
     unsigned int time_stamp;
-    size_t size;
+    time_t expires;          /* 0 for objects that never expire */
+    size_t size;             /* header_size plus the stored body's size */
+    size_t header_size;
+    size_t body_size;        /* body size once decompressed */
+    int compressed;          /* body stored lz-compressed after the header */
     char hostname[MAXLINE];
     int port;
     char uri[MAXLINE];
-    unsigned char *data;
+    char *header;            /* response header, owned by this object */
+    cache_body *body;
+    int refcnt;              /* the list's reference plus readers holding it */
     struct cache_elem *next;
 } cache_elem;
 
 
+/*
+ * How one object is framed by cache_save, followed by hostname, uri, the
+ * header and the stored body
+ */
+typedef struct cache_record {
+    unsigned int time_stamp;
+    time_t expires;
+    int port;
+    int compressed;
+    size_t hostname_len, uri_len;
+    size_t size, header_size, body_size;
+} cache_record;
+
 typedef struct cache_list {
     cache_elem *head;
     size_t total_cache_size;
+    size_t budget;           /* high watermark: above it, eviction starts */
+    unsigned long evicted;
+    cache_body *bodies[CACHE_BODY_BUCKETS];
 } cache_list;
 
 /*Function prototypes*/
 void initialize_cache();
 cache_elem* check_cache_list(cache_list *cache, char *hostname, int *port, char *uri);
-void insert_to_cache(cache_list *cache, char *hostname, int *port, char *uri, 
-                          unsigned char *data, size_t insert_size);
+void insert_to_cache(cache_list *cache, char *hostname, int *port, char *uri,
+                     char *header, size_t header_size,
+                     unsigned char *body, size_t body_size, time_t expires, int compress);
+ssize_t read_from_cache(cache_elem *cache_ptr, unsigned char *buf);
+void cache_release(cache_elem *cache_ptr);
+int cache_save(cache_list *cache, int fd);
+int cache_load(cache_list *cache, int fd);
+void cache_clear(cache_list *cache);
+void cache_set_budget(cache_list *cache, size_t budget);
+void cache_dump_stats(cache_list *cache, FILE *fp);
+void remove_from_cache(cache_list *cache, char *hostname, int *port, char *uri);
 void eviction(cache_list *cache);
-unsigned int update_least_time(cache_list *cache, cache_elem *cache_ptr);
 
@@ -0,0 +1,316 @@
+/*
+ * Name: Chih-Feng Lin
+         Chi-Heng Wu
+ * Andrew ID: chihfenl
+              chihengw
+
+ *
+ * cachebench.c - multi-threaded microbenchmark for cache.c. Every thread
+ *                repeatedly picks a key (uniform or Zipfian), looks it up
+ *                with check_cache_list and inserts it with insert_to_cache
+ *                on a miss, exactly like the proxy does. Each operation is
+ *                timed, and for every thread count we report throughput and
+ *                latency percentiles for lookups, plain inserts and inserts
+ *                that had to evict.
+ *
+ *                usage: cachebench [-t max_threads] [-n ops_per_thread]
+ *                                  [-k keys] [-s object_size] [-d uniform|zipf]
+ *                                  [-a zipf_exponent] [-z] [-u]
+ *
+ *                Every key gets a body of its own unless -u makes all keys
+ *                carry the same one, which the cache then stores only once.
+ */
+
+#include "cache.h"
+
+#define BENCH_HOST "bench.example"
+
+/* Operation kinds we keep latency samples for */
+enum { OP_LOOKUP, OP_INSERT, OP_EVICT, OP_KINDS };
+static const char *op_names[OP_KINDS] = {"lookup", "insert", "evict"};
+
+typedef struct bench_thread {
+    pthread_t tid;
+    unsigned long long rng;
+    long *samples[OP_KINDS];    /* latency of each operation in ns */
+    long count[OP_KINDS];
+    long hits;
+} bench_thread;
+
+/*Benchmark parameters*/
+static int max_threads = 8;
+static long ops_per_thread = 100000;
+static int key_count = 1000;
+static size_t object_size = 8192;
+static int use_zipf = 1;
+static double zipf_exponent = 0.99;
+static int compress = 0;
+static int same_body = 0;
+
+static cache_list *cache;
+static double *zipf_cdf;
+static unsigned char *object_body;
+static char object_header[] = "HTTP/1.0 200 OK\r\n\r\n";
+
+/*Function prototypes*/
+static void usage(char *prog);
+static void build_zipf_cdf(void);
+static int next_key(bench_thread *bt);
+static unsigned long long xorshift(unsigned long long *state);
+static long now_ns(void);
+static void *bench_worker(void *vargp);
+static void run(int nthreads);
+static void report(char *name, long *samples, long n, double seconds);
+static int cmp_long(const void *a, const void *b);
+static void reset_cache(void);
+static void fill_text(unsigned char *buf, size_t size);
+
+
+int main(int argc, char **argv)
+{
+    int opt, nthreads;
+
+    while((opt = getopt(argc, argv, "t:n:k:s:d:a:zu")) != -1) {
+        switch(opt) {
+        case 't': max_threads = atoi(optarg); break;
+        case 'n': ops_per_thread = atol(optarg); break;
+        case 'k': key_count = atoi(optarg); break;
+        case 's': object_size = atol(optarg); break;
+        case 'd': use_zipf = !strcmp(optarg, "zipf"); break;
+        case 'a': zipf_exponent = atof(optarg); break;
+        case 'z': compress = 1; break;
+        case 'u': same_body = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if(max_threads < 1 || ops_per_thread < 1 || key_count < 1 ||
+            object_size + sizeof(object_header) > MAX_OBJECT_SIZE)
+        usage(argv[0]);
+
+    object_body = (unsigned char*)Calloc(1, object_size);
+    if(compress)
+        fill_text(object_body, object_size);
+    if(use_zipf)
+        build_zipf_cdf();
+
+    printf("cachebench: %d keys, %lu-byte %s%sobjects, %s keys, %ld ops/thread, "
+           "%d-byte cache\n", key_count, (unsigned long)object_size,
+           compress ? "compressed " : "", same_body ? "identical " : "",
+           use_zipf ? "zipf" : "uniform",
+           ops_per_thread, DEFAULT_CACHE_SIZE);
+
+    /*Thread counts 1, 2, 4, ... and finally max_threads itself*/
+    for(nthreads = 1; nthreads < max_threads; nthreads *= 2) {
+        run(nthreads);
+    }
+    run(max_threads);
+    return 0;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-t max_threads] [-n ops_per_thread] [-k keys] "
+                    "[-s object_size] [-d uniform|zipf] [-a zipf_exponent] [-z] [-u]\n", prog);
+    exit(1);
+}
+
+/*
+ * run - Start nthreads workers on an empty cache, wait for them and print
+ *       one line per operation kind
+ */
+static void run(int nthreads)
+{
+    bench_thread *threads;
+    long *merged, n, hits = 0, lookups = 0;
+    long start, elapsed;
+    int i, k;
+    double seconds;
+
+    reset_cache();
+    threads = (bench_thread*)Calloc(nthreads, sizeof(bench_thread));
+
+    start = now_ns();
+    for(i = 0; i < nthreads; i++) {
+        threads[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        for(k = 0; k < OP_KINDS; k++) {
+            threads[i].samples[k] = (long*)Malloc(ops_per_thread * sizeof(long));
+        }
+        Pthread_create(&threads[i].tid, NULL, bench_worker, &threads[i]);
+    }
+    for(i = 0; i < nthreads; i++) {
+        Pthread_join(threads[i].tid, NULL);
+    }
+    elapsed = now_ns() - start;
+    seconds = elapsed / 1e9;
+
+    for(i = 0; i < nthreads; i++) {
+        hits += threads[i].hits;
+        lookups += threads[i].count[OP_LOOKUP];
+    }
+    printf("\nthreads=%d  elapsed=%.3fs  hit ratio=%.3f\n", nthreads, seconds,
+           lookups ? (double)hits / lookups : 0.0);
+    printf("  %-7s %12s %10s %10s %10s %10s\n",
+           "op", "ops/sec", "p50(ns)", "p90(ns)", "p99(ns)", "p99.9(ns)");
+
+    /*Merge every thread's samples per operation kind*/
+    merged = (long*)Malloc(nthreads * ops_per_thread * sizeof(long));
+    for(k = 0; k < OP_KINDS; k++) {
+        n = 0;
+        for(i = 0; i < nthreads; i++) {
+            memcpy(merged + n, threads[i].samples[k], threads[i].count[k] * sizeof(long));
+            n += threads[i].count[k];
+        }
+        report((char*)op_names[k], merged, n, seconds);
+    }
+
+    free(merged);
+    for(i = 0; i < nthreads; i++) {
+        for(k = 0; k < OP_KINDS; k++) {
+            free(threads[i].samples[k]);
+        }
+    }
+    free(threads);
+}
+
+/*Lookup, and insert on a miss, ops_per_thread times*/
+static void *bench_worker(void *vargp)
+{
+    bench_thread *bt = (bench_thread*)vargp;
+    char uri[MAXLINE];
+    int port = 80, kind, key;
+    long op, t0, t1;
+    cache_elem *found;
+    unsigned char object[MAX_OBJECT_SIZE], body[MAX_OBJECT_SIZE];
+
+    memcpy(body, object_body, object_size);
+    for(op = 0; op < ops_per_thread; op++) {
+        key = next_key(bt);
+        sprintf(uri, "/object/%d", key);
+
+        t0 = now_ns();
+        found = check_cache_list(cache, BENCH_HOST, &port, uri);
+        if(found && found->compressed)
+            read_from_cache(found, object);   /*a hit pays for expanding it*/
+        if(found)
+            cache_release(found);
+        t1 = now_ns();
+        bt->samples[OP_LOOKUP][bt->count[OP_LOOKUP]++] = t1 - t0;
+        if(found) {
+            bt->hits++;
+            continue;
+        }
+
+        /*An insert into a full cache pays for the eviction as well*/
+        kind = (cache->total_cache_size + sizeof(object_header) + object_size > cache->budget)
+               ? OP_EVICT : OP_INSERT;
+        /*Stamp the key into the body so it is unique, unless -u*/
+        if(!same_body)
+            memcpy(body, &key, object_size < sizeof(key) ? object_size : sizeof(key));
+        t0 = now_ns();
+        insert_to_cache(cache, BENCH_HOST, &port, uri, object_header,
+                        sizeof(object_header) - 1, body, object_size, 0, compress);
+        t1 = now_ns();
+        bt->samples[kind][bt->count[kind]++] = t1 - t0;
+    }
+    return NULL;
+}
+
+static void report(char *name, long *samples, long n, double seconds)
+{
+    if(n == 0) {
+        printf("  %-7s %12s\n", name, "-");
+        return;
+    }
+    qsort(samples, n, sizeof(long), cmp_long);
+    printf("  %-7s %12.0f %10ld %10ld %10ld %10ld\n", name, n / seconds,
+           samples[n * 50 / 100], samples[n * 90 / 100],
+           samples[n * 99 / 100], samples[n * 999 / 1000]);
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long*)a, y = *(const long*)b;
+    return (x > y) - (x < y);
+}
+
+/*Drop every cached object and start from an empty cache*/
+static void reset_cache(void)
+{
+    if(cache != NULL) {
+        cache_clear(cache);
+        free(cache);
+    }
+    cache = (cache_list*)Calloc(1, sizeof(cache_list));
+    cache->budget = DEFAULT_CACHE_SIZE;
+    initialize_cache();
+}
+
+/*Text-like filler for -z, so compression sees realistic redundancy*/
+static void fill_text(unsigned char *buf, size_t size)
+{
+    char line[MAXLINE];
+    size_t off = 0, len;
+    int i = 0;
+
+    while(off < size) {
+        len = sprintf(line, "<li class=\"item\"><a href=\"/object/%d\">item %d</a></li>\n",
+                      i * 7919 % 100000, i);
+        if(len > size - off)
+            len = size - off;
+        memcpy(buf + off, line, len);
+        off += len;
+        i++;
+    }
+}
+
+/*Cumulative distribution of P(k) ~ 1 / k^s over the key space*/
+static void build_zipf_cdf(void)
+{
+    double sum = 0;
+    int i;
+
+    zipf_cdf = (double*)Malloc(key_count * sizeof(double));
+    for(i = 0; i < key_count; i++) {
+        sum += 1.0 / pow(i + 1, zipf_exponent);
+        zipf_cdf[i] = sum;
+    }
+    for(i = 0; i < key_count; i++) {
+        zipf_cdf[i] /= sum;
+    }
+}
+
+static int next_key(bench_thread *bt)
+{
+    double u;
+    int lo = 0, hi = key_count - 1, mid;
+
+    if(!use_zipf)
+        return xorshift(&bt->rng) % key_count;
+
+    /*Binary search for the first key whose CDF reaches u*/
+    u = (xorshift(&bt->rng) >> 11) * (1.0 / 9007199254740992.0);
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if(zipf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static unsigned long long xorshift(unsigned long long *state)
+{
+    unsigned long long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
@@ -574,6 +574,63 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/* Linux's limit on buffers per writev() call, where no header says */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*
+ * rio_writev - robustly write the buffers of iov as one gather write
+ *    (unbuffered). A short write resumes where it stopped, adjusting iov
+ *    in place. On sockets, more != 0 sends with MSG_MORE: the kernel holds
+ *    a partial segment back for the next write instead of pushing a small
+ *    packet. Returns the total bytes written or -1 with errno set.
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt, int more)
+{
+    struct msghdr msg;
+    size_t total = 0;
+    ssize_t nwritten;
+    int use_send = 1;
+
+    memset(&msg, 0, sizeof(msg));
+    while (iovcnt > 0) {
+	if (iov->iov_len == 0) {     /* skip drained and empty buffers */
+	    iov++;
+	    iovcnt--;
+	    continue;
+	}
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+	if (use_send)
+	    nwritten = sendmsg(fd, &msg, more ? MSG_MORE : 0);
+	else
+	    nwritten = writev(fd, iov, msg.msg_iovlen);
+	if (nwritten < 0) {
+	    if (errno == ENOTSOCK && use_send) {
+		use_send = 0;        /* a pipe or file: plain writev */
+		continue;
+	    }
+	    if (errno == EINTR)      /* interrupted by sig handler return */
+		continue;
+	    return -1;
+	}
+	total += nwritten;
+
+	/* Drop the buffers written in full, trim the one cut short */
+	while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+	    nwritten -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return total;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -650,33 +707,118 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 }
 /* $end rio_readnb */
 
+/*
+ * rio_readsomeb - Read up to n bytes (buffered), returning as soon as
+ *    any are available instead of waiting for all n like rio_readnb
+ */
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n)
+{
+    ssize_t nread;
+
+    while ((nread = rio_read(rp, usrbuf, n)) < 0) {
+	if (errno != EINTR) /* interrupted by sig handler return */
+	    return -1;      /* errno set by read() */
+    }
+    return nread;       /* 0 on EOF */
+}
+
 /* 
- * rio_readlineb - robustly read a text line (buffered)
+ * rio_readlineb - robustly read a text line (buffered). The buffer is
+ *    searched for the newline with memchr and copied a run at a time.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-	if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n')
-		break;
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* error */
+    size_t n = 0, run;
+    char *bufp = usrbuf, *nl;
+    char c;
+    int rc;
+
+    while (n + 1 < maxlen) {
+	if (rp->rio_cnt <= 0) {
+	    /* Refill through rio_read, then put the byte back */
+	    if ((rc = rio_read(rp, &c, 1)) < 0)
+		return -1;    /* error */
+	    if (rc == 0)
+		break;        /* EOF */
+	    rp->rio_bufptr--;
+	    rp->rio_cnt++;
+	}
+
+	run = maxlen - 1 - n;
+	if (run > rp->rio_cnt)
+	    run = rp->rio_cnt;
+	if ((nl = memchr(rp->rio_bufptr, '\n', run)) != NULL)
+	    run = nl - rp->rio_bufptr + 1;
+	memcpy(bufp + n, rp->rio_bufptr, run);
+	rp->rio_bufptr += run;
+	rp->rio_cnt -= run;
+	n += run;
+	if (nl != NULL)
+	    break;
     }
-    *bufp = 0;
+    if (n == 0 && maxlen > 1)
+	return 0;             /* EOF, no data read */
+    bufp[n] = 0;
     return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_readlinev - read a text line without copying it: *linep is set to
+ *    the line inside the rio buffer, newline included but not
+ *    NUL-terminated, and stays valid until the next read from rp. Lines
+ *    longer than maxlen - 1 bytes, or than the RIO_BUFSIZE buffer, are split
+ *    like rio_readlineb does. To keep a line contiguous the unread bytes
+ *    are moved to the front of the buffer. Returns the line length, 0 on
+ *    EOF, -1 on error.
+ */
+ssize_t rio_readlinev(rio_t *rp, char **linep, size_t maxlen)
+{
+    size_t want = maxlen - 1, scanned = 0, len;
+    char *nl;
+    ssize_t rc;
+
+    if (maxlen <= 1)
+	return 0;
+    while (1) {
+	/* Search only the bytes we have not looked at yet */
+	len = rp->rio_cnt < want ? rp->rio_cnt : want;
+	if ((nl = memchr(rp->rio_bufptr + scanned, '\n', len - scanned)) != NULL) {
+	    len = nl - rp->rio_bufptr + 1;
+	    break;
+	}
+	scanned = len;
+	if (len == want)
+	    break;            /* as long as the caller allows */
+
+	/* Make room after the partial line */
+	if (rp->rio_bufptr != rp->rio_buf) {
+	    memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	    rp->rio_bufptr = rp->rio_buf;
+	}
+	if (rp->rio_cnt == RIO_BUFSIZE)
+	    break;            /* the buffer is full, split the line */
+
+	rc = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, RIO_BUFSIZE - rp->rio_cnt);
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (rc == 0) {
+	    len = rp->rio_cnt;  /* EOF: the rest is the last line */
+	    break;
+	}
+	rp->rio_cnt += rc;
+    }
+
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += len;
+    rp->rio_cnt -= len;
+    return len;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -761,15 +903,29 @@ int open_clientfd(char *hostname, int port)
  */
 int open_clientfd_r(char *hostname, int port) {
     int clientfd;
-    struct addrinfo *addlist, *p;
-    char port_str[MAXLINE];
-    int rv;
 
     /* Create the socket descriptor */
     if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         return -1;
     }
 
+    if (connect_clientfd_r(clientfd, hostname, port) < 0) {
+        close(clientfd);
+        return -1;
+    }
+    return clientfd;
+}
+
+/*
+ * connect_clientfd_r - connect an existing socket to hostname:port, so the
+ *     caller can put a deadline on the socket before the connect blocks.
+ *     Returns -1 if no address could be connected; clientfd stays open.
+ */
+int connect_clientfd_r(int clientfd, char *hostname, int port) {
+    struct addrinfo *addlist, *p;
+    char port_str[MAXLINE];
+    int rv;
+
     /* Get a list of addrinfo structs */
     sprintf(port_str, "%d", port);
     if ((rv = getaddrinfo(hostname, port_str, NULL, &addlist)) != 0) {
@@ -787,13 +943,7 @@ int open_clientfd_r(char *hostname, int port) {
 
     /* Clean up */
     freeaddrinfo(addlist);
-    if (!p) { /* all connects failed */
-        close(clientfd);
-        return -1;
-    }
-    else { /* one of the connects succeeded */
-        return clientfd;
-    }
+    return p ? 0 : -1;
 }
 
 /*  
@@ -0,0 +1,384 @@
+/*
+ * Name: Chih-Feng Lin
+         Chi-Heng Wu
+ * Andrew ID: chihfenl
+              chihengw
+
+ *
+ * http.c - helpers for reading origin responses. The response header is
+ *          read line by line and its framing headers are noted; a chunked
+ *          body is decoded by a small state machine that accepts the body
+ *          in arbitrary pieces, so data can be forwarded as it arrives.
+ *          Range headers and stored headers can be taken apart for
+ *          answering partial requests from the cache.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include "http.h"
+
+static int hex_value(unsigned char c);
+static int is_text_type(const char *value);
+
+/*Return the status code of an HTTP status line, or 0 if it is not one*/
+int http_parse_status(const char *status_line)
+{
+    const char *value;
+
+    if(strncmp(status_line, "HTTP/", 5) || (value = strchr(status_line, ' ')) == NULL)
+        return 0;
+    return atoi(value + 1);
+}
+
+/*
+ * http_read_response_header - Read the status line and header lines into
+ *     header (without the terminating blank line) and fill in resp. For a
+ *     chunked response the Transfer-Encoding and Content-Length lines are
+ *     dropped, since the proxy delivers the body de-chunked.
+ *     resp->compressible tells whether the body is text worth compressing,
+ *     resp->html whether it is an HTML page we can read.
+ *     Returns the header length, 0 on EOF or -1 on error/overflow.
+ */
+ssize_t http_read_response_header(rio_t *rio, char *header, size_t maxlen,
+                                  http_response *resp)
+{
+    char *line, *buf;
+    size_t header_size = 0, line_size, cl_start = 0, cl_size = 0;
+    ssize_t read_num;
+    int text = 0, encoded = 0, html = 0;
+
+    resp->status = 0;
+    resp->chunked = 0;
+    resp->content_length = -1;
+    resp->compressible = 0;
+    resp->html = 0;
+
+    /*
+     * Lines are taken as views of the rio buffer and copied straight into
+     * header, where they are NUL-terminated and examined
+     */
+    if((read_num = rio_readlinev(rio, &line, MAXLINE)) <= 0)
+        return read_num;
+    if(read_num >= maxlen)
+        return -1;
+    memcpy(header, line, read_num);
+    header[read_num] = '\0';
+    resp->status = http_parse_status(header);
+    header_size = read_num;
+
+    /*Header lines up to the blank line*/
+    while((read_num = rio_readlinev(rio, &line, MAXLINE)) > 0) {
+        if(line[0] == '\n' || (read_num == 2 && line[0] == '\r'))
+            break;
+        line_size = read_num;
+        if(header_size + line_size >= maxlen)
+            return -1;
+        buf = header + header_size;
+        memcpy(buf, line, line_size);
+        buf[line_size] = '\0';
+
+        if(!strncasecmp(buf, "Transfer-Encoding:", 18)) {
+            if(strcasestr(buf + 18, "chunked") != NULL) {
+                resp->chunked = 1;
+                continue;
+            }
+        } else if(!strncasecmp(buf, "Content-Length:", 15)) {
+            resp->content_length = atol(buf + 15);
+            cl_start = header_size;
+            cl_size = line_size;
+        } else if(!strncasecmp(buf, "Content-Type:", 13)) {
+            text = is_text_type(buf + 13);
+            html = (strcasestr(buf + 13, "text/html") != NULL);
+        } else if(!strncasecmp(buf, "Content-Encoding:", 17)) {
+            encoded = (strcasestr(buf + 17, "identity") == NULL);
+        }
+        header_size += line_size;
+    }
+    if(read_num < 0)
+        return -1;
+
+    /*Chunked framing wins over Content-Length, which must then be removed*/
+    if(resp->chunked && cl_size > 0) {
+        memmove(header + cl_start, header + cl_start + cl_size,
+                header_size - cl_start - cl_size);
+        header_size -= cl_size;
+        resp->content_length = -1;
+    }
+
+    resp->compressible = text && !encoded;
+    resp->html = html && !encoded;
+    header[header_size] = '\0';
+    return header_size;
+}
+
+/*
+ * http_parse_range - Parse the value of a Range header ("bytes=0-99,-500")
+ *     against a body of size bytes. Satisfiable ranges are clipped to the
+ *     body and stored in order. Returns their number, 0 if none of them is
+ *     satisfiable (a 416), or -1 if the header is malformed, not in bytes
+ *     or asks for more than max_ranges pieces; it is then ignored.
+ */
+int http_parse_range(const char *spec, long size, http_range *ranges, int max_ranges)
+{
+    const char *p;
+    char *end;
+    long first, last;
+    int n = 0, parts = 0;
+
+    while(*spec == ' ')
+        spec++;
+    if(strncasecmp(spec, "bytes=", 6))
+        return -1;
+
+    for(p = spec + 6; *p; ) {
+        while(*p == ' ' || *p == ',')
+            p++;
+        if(*p == '\0' || *p == '\r' || *p == '\n')
+            break;
+        if(++parts > max_ranges)
+            return -1;
+
+        if(*p == '-') {
+            /*Suffix: the last N bytes*/
+            last = strtol(p + 1, &end, 10);
+            if(end == p + 1 || last < 0)
+                return -1;
+            first = size - last;
+            last = size - 1;
+            if(first < 0)
+                first = 0;
+        } else {
+            first = strtol(p, &end, 10);
+            if(end == p || *end != '-' || first < 0)
+                return -1;
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if(end == p)
+                last = size - 1;
+            else if(last < first)
+                return -1;
+        }
+        p = end;
+        while(*p == ' ')
+            p++;
+        if(*p != ',' && *p != '\0' && *p != '\r' && *p != '\n')
+            return -1;
+
+        if(first >= size || first > last)
+            continue;
+        ranges[n].first = first;
+        ranges[n].last = last < size ? last : size - 1;
+        n++;
+    }
+    return parts > 0 ? n : -1;
+}
+
+/*
+ * http_header_lines - Copy the header lines of a complete header (status
+ *     line and final blank line excluded) into dst, leaving out the fields
+ *     named in the NULL-terminated skip list. Returns the bytes copied.
+ */
+size_t http_header_lines(char *dst, const char *header, size_t header_size,
+                         const char **skip)
+{
+    const char *line, *next, *end = header + header_size;
+    size_t len, copied = 0, name_len;
+    int i, keep;
+
+    line = memchr(header, '\n', header_size);
+    for(line = line ? line + 1 : end; line < end; line = next) {
+        next = memchr(line, '\n', end - line);
+        next = next ? next + 1 : end;
+        len = next - line;
+        if(line[0] == '\r' || line[0] == '\n')
+            break;
+
+        keep = 1;
+        for(i = 0; skip[i] != NULL && keep; i++) {
+            name_len = strlen(skip[i]);
+            if(len > name_len && line[name_len] == ':' && !strncasecmp(line, skip[i], name_len))
+                keep = 0;
+        }
+        if(keep) {
+            memcpy(dst + copied, line, len);
+            copied += len;
+        }
+    }
+    return copied;
+}
+
+/*
+ * http_header_value - Find a field in a complete header and copy its value,
+ *     without surrounding blanks, into value. Returns -1 if it is absent.
+ */
+int http_header_value(const char *header, size_t header_size, const char *name,
+                      char *value, size_t maxlen)
+{
+    const char *line, *next, *end = header + header_size;
+    size_t name_len = strlen(name), len;
+
+    for(line = header; line < end; line = next) {
+        next = memchr(line, '\n', end - line);
+        next = next ? next + 1 : end;
+        if(next - line > name_len && line[name_len] == ':' &&
+                !strncasecmp(line, name, name_len)) {
+            line += name_len + 1;
+            while(line < next && (*line == ' ' || *line == '\t'))
+                line++;
+            len = next - line;
+            while(len > 0 && isspace((unsigned char)line[len - 1]))
+                len--;
+            if(len >= maxlen)
+                len = maxlen - 1;
+            memcpy(value, line, len);
+            value[len] = '\0';
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * http_finish_header - Terminate a header read by http_read_response_header.
+ *     A de-chunked body of known size gets a Content-Length line; pass a
+ *     negative body_size when the size is not known yet, in which case the
+ *     body is delimited by closing the connection. The caller must leave
+ *     HTTP_FINISH_ROOM bytes free. Returns the new header length.
+ */
+size_t http_finish_header(char *header, size_t header_size, http_response *resp,
+                          long body_size)
+{
+    if(resp->chunked && body_size >= 0)
+        header_size += sprintf(header + header_size, "Content-Length: %ld\r\n",
+                               body_size);
+    header_size += sprintf(header + header_size, "\r\n");
+    return header_size;
+}
+
+void chunk_decoder_init(chunk_decoder *dec)
+{
+    dec->state = CHUNK_SIZE;
+    dec->remaining = 0;
+}
+
+/*
+ * chunk_decode - Decode the next len bytes of a chunked body in place.
+ *     Returns the number of payload bytes left at the front of buf, or -1
+ *     if the input is malformed. Bytes after the final chunk are dropped;
+ *     dec->state becomes CHUNK_DONE once the body is complete.
+ */
+ssize_t chunk_decode(chunk_decoder *dec, unsigned char *buf, size_t len)
+{
+    size_t in = 0, out = 0, n;
+    unsigned char c;
+    int digit;
+
+    while(in < len && dec->state != CHUNK_DONE) {
+        c = buf[in];
+
+        switch(dec->state) {
+        case CHUNK_SIZE:
+            if((digit = hex_value(c)) >= 0) {
+                if(dec->remaining > (SIZE_MAX >> 4)) {
+                    dec->state = CHUNK_ERROR;
+                    return -1;
+                }
+                dec->remaining = (dec->remaining << 4) | digit;
+            } else if(c == '\n') {
+                dec->state = dec->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+            } else if(c == ';' || c == ' ' || c == '\t' || c == '\r') {
+                dec->state = CHUNK_EXT;
+            } else {
+                dec->state = CHUNK_ERROR;
+                return -1;
+            }
+            in++;
+            break;
+
+        case CHUNK_EXT:
+            if(c == '\n')
+                dec->state = dec->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+            in++;
+            break;
+
+        case CHUNK_DATA:
+            /*Copy as much of the payload as this piece holds*/
+            n = len - in;
+            if(n > dec->remaining)
+                n = dec->remaining;
+            memmove(buf + out, buf + in, n);
+            in += n;
+            out += n;
+            dec->remaining -= n;
+            if(dec->remaining == 0)
+                dec->state = CHUNK_DATA_CR;
+            break;
+
+        case CHUNK_DATA_CR:
+        case CHUNK_DATA_LF:
+            if(c == '\n')
+                dec->state = CHUNK_SIZE;
+            else if(c == '\r' && dec->state == CHUNK_DATA_CR)
+                dec->state = CHUNK_DATA_LF;
+            else {
+                dec->state = CHUNK_ERROR;
+                return -1;
+            }
+            in++;
+            break;
+
+        case CHUNK_TRAILER:
+            if(c == '\n')
+                dec->state = CHUNK_DONE;
+            else if(c == '\r')
+                dec->state = CHUNK_TRAILER_LF;
+            else
+                dec->state = CHUNK_TRAILER_LINE;
+            in++;
+            break;
+
+        case CHUNK_TRAILER_LINE:
+            if(c == '\n')
+                dec->state = CHUNK_TRAILER;
+            in++;
+            break;
+
+        case CHUNK_TRAILER_LF:
+            if(c != '\n') {
+                dec->state = CHUNK_ERROR;
+                return -1;
+            }
+            dec->state = CHUNK_DONE;
+            in++;
+            break;
+
+        default:
+            return -1;
+        }
+    }
+    return out;
+}
+
+/*Media types that are text in practice and shrink well*/
+static int is_text_type(const char *value)
+{
+    static const char *types[] = {"text/", "javascript", "json", "xml", "svg", NULL};
+    int i;
+
+    for(i = 0; types[i] != NULL; i++) {
+        if(strcasestr(value, types[i]) != NULL)
+            return 1;
+    }
+    return 0;
+}
+
+static int hex_value(unsigned char c)
+{
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
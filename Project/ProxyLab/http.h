@@ -0,0 +1,54 @@
+#include "csapp.h"
+
+/* Header space http_finish_header may append: Content-Length plus CRLF */
+#define HTTP_FINISH_ROOM 64
+
+/* Most byte ranges one Range header may ask for before we send everything */
+#define HTTP_MAX_RANGES 16
+
+/* An inclusive, satisfiable byte range of a body */
+typedef struct http_range {
+    long first, last;
+} http_range;
+
+/* What the proxy needs to know about an origin response header */
+typedef struct http_response {
+    int status;             /* status code, 0 if the status line was unusable */
+    int chunked;            /* Transfer-Encoding: chunked */
+    long content_length;    /* -1 when absent */
+    int compressible;       /* textual Content-Type, no Content-Encoding */
+    int html;               /* plain text/html */
+} http_response;
+
+/* States of the streaming chunked-body decoder */
+typedef enum {
+    CHUNK_SIZE,             /* reading the hex chunk size */
+    CHUNK_EXT,              /* skipping chunk extensions up to LF */
+    CHUNK_DATA,             /* copying chunk payload */
+    CHUNK_DATA_CR,          /* expecting CR after the payload */
+    CHUNK_DATA_LF,          /* expecting LF after the payload */
+    CHUNK_TRAILER,          /* at the start of a trailer line */
+    CHUNK_TRAILER_LINE,     /* skipping a trailer line */
+    CHUNK_TRAILER_LF,       /* expecting LF of the final empty line */
+    CHUNK_DONE,             /* last chunk and trailers consumed */
+    CHUNK_ERROR             /* malformed input */
+} chunk_state;
+
+typedef struct chunk_decoder {
+    chunk_state state;
+    size_t remaining;       /* payload bytes left in the current chunk */
+} chunk_decoder;
+
+/*Function prototypes*/
+int http_parse_status(const char *status_line);
+ssize_t http_read_response_header(rio_t *rio, char *header, size_t maxlen,
+                                  http_response *resp);
+size_t http_finish_header(char *header, size_t header_size, http_response *resp,
+                          long body_size);
+int http_parse_range(const char *spec, long size, http_range *ranges, int max_ranges);
+size_t http_header_lines(char *dst, const char *header, size_t header_size,
+                         const char **skip);
+int http_header_value(const char *header, size_t header_size, const char *name,
+                      char *value, size_t maxlen);
+void chunk_decoder_init(chunk_decoder *dec);
+ssize_t chunk_decode(chunk_decoder *dec, unsigned char *buf, size_t len);
@@ -0,0 +1,172 @@
+/*
+ * Name: Chih-Feng Lin
+         Chi-Heng Wu
+ * Andrew ID: chihfenl
+              chihengw
+
+ *
+ * lz.c - small byte-oriented LZ77 codec for cached bodies, laid out like an
+ *        LZ4 block. Each sequence is a token byte (literal count in the high
+ *        nibble, match length - LZ_MIN_MATCH in the low one, 15 meaning
+ *        "more length bytes follow"), the literals, then a 2-byte
+ *        little-endian back offset and any extra match length bytes. The
+ *        last sequence stops after its literals. Matches are found through
+ *        a single hash table of recent 4-byte prefixes; runs without
+ *        matches are skipped over faster and faster, so incompressible
+ *        data costs little.
+ */
+
+#include "lz.h"
+
+static int put_sequence(unsigned char *dst, size_t *op, size_t dst_cap,
+                        const unsigned char *literals, size_t literal_len,
+                        size_t offset, size_t match_len);
+static unsigned char *put_length(unsigned char *p, size_t len);
+
+static inline unsigned int read32(const unsigned char *p)
+{
+    unsigned int v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned int hash32(unsigned int v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * lz_compress - Compress src into dst. Returns the compressed size, or 0 if
+ *               the result would not fit in dst_cap bytes, which callers use
+ *               to keep data that does not shrink uncompressed.
+ */
+size_t lz_compress(const unsigned char *src, size_t src_size,
+                   unsigned char *dst, size_t dst_cap)
+{
+    unsigned int table[1 << LZ_HASH_BITS];
+    size_t ip = 0, anchor = 0, op = 0, ref, len;
+    unsigned int v, h;
+
+    memset(table, 0, sizeof(table));
+
+    while(ip + LZ_MIN_MATCH <= src_size) {
+        v = read32(src + ip);
+        h = hash32(v);
+        ref = table[h];
+        table[h] = ip;
+
+        if(ref < ip && ip - ref <= LZ_MAX_OFFSET && read32(src + ref) == v) {
+            len = LZ_MIN_MATCH;
+            while(ip + len < src_size && src[ref + len] == src[ip + len])
+                len++;
+            if(put_sequence(dst, &op, dst_cap, src + anchor, ip - anchor, ip - ref, len) < 0)
+                return 0;
+            ip += len;
+            anchor = ip;
+        } else {
+            /*Step further the longer we go without a match*/
+            ip += 1 + ((ip - anchor) >> 6);
+        }
+    }
+
+    /*Whatever is left goes out as literals*/
+    if(put_sequence(dst, &op, dst_cap, src + anchor, src_size - anchor, 0, 0) < 0)
+        return 0;
+    return op;
+}
+
+/*
+ * lz_decompress - Expand src into dst. Returns the expanded size, or -1 if
+ *                 src is malformed or would expand beyond dst_cap.
+ */
+ssize_t lz_decompress(const unsigned char *src, size_t src_size,
+                      unsigned char *dst, size_t dst_cap)
+{
+    size_t ip = 0, op = 0, len, offset;
+    unsigned char token, b;
+
+    while(ip < src_size) {
+        token = src[ip++];
+
+        /*Literals*/
+        len = token >> 4;
+        if(len == 15) {
+            do {
+                if(ip >= src_size)
+                    return -1;
+                b = src[ip++];
+                len += b;
+            } while(b == 255);
+        }
+        if(len > src_size - ip || len > dst_cap - op)
+            return -1;
+        memcpy(dst + op, src + ip, len);
+        ip += len;
+        op += len;
+        if(ip == src_size)
+            break;
+
+        /*Match, which may overlap the bytes it produces*/
+        if(src_size - ip < 2)
+            return -1;
+        offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > op)
+            return -1;
+        len = token & 15;
+        if(len == 15) {
+            do {
+                if(ip >= src_size)
+                    return -1;
+                b = src[ip++];
+                len += b;
+            } while(b == 255);
+        }
+        len += LZ_MIN_MATCH;
+        if(len > dst_cap - op)
+            return -1;
+        for(; len > 0; len--, op++)
+            dst[op] = dst[op - offset];
+    }
+    return op;
+}
+
+/*Append one sequence; a zero match_len ends the stream after the literals*/
+static int put_sequence(unsigned char *dst, size_t *op, size_t dst_cap,
+                        const unsigned char *literals, size_t literal_len,
+                        size_t offset, size_t match_len)
+{
+    unsigned char *p = dst + *op;
+    size_t match_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+    /*Worst case: token, both length extensions, literals and the offset*/
+    if(*op + 1 + literal_len / 255 + 1 + literal_len + 2 + match_code / 255 + 1 > dst_cap)
+        return -1;
+
+    *p++ = ((literal_len < 15 ? literal_len : 15) << 4) |
+           (match_code < 15 ? match_code : 15);
+    if(literal_len >= 15)
+        p = put_length(p, literal_len - 15);
+    memcpy(p, literals, literal_len);
+    p += literal_len;
+
+    if(match_len) {
+        *p++ = offset & 0xff;
+        *p++ = offset >> 8;
+        if(match_code >= 15)
+            p = put_length(p, match_code - 15);
+    }
+    *op = p - dst;
+    return 0;
+}
+
+static unsigned char *put_length(unsigned char *p, size_t len)
+{
+    while(len >= 255) {
+        *p++ = 255;
+        len -= 255;
+    }
+    *p++ = len;
+    return p;
+}
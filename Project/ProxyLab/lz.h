@@ -0,0 +1,13 @@
+#include "csapp.h"
+
+/* Shortest match worth encoding, and how far back a match may reach */
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+/* log2 of the compressor's match-finder table size */
+#define LZ_HASH_BITS 12
+
+/*Function prototypes*/
+size_t lz_compress(const unsigned char *src, size_t src_size,
+                   unsigned char *dst, size_t dst_cap);
+ssize_t lz_decompress(const unsigned char *src, size_t src_size,
+                      unsigned char *dst, size_t dst_cap);
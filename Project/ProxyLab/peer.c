@@ -0,0 +1,232 @@
+/*
+ * Name: Chih-Feng Lin
+         Chi-Heng Wu
+ * Andrew ID: chihfenl
+              chihengw
+
+ *
+ * peer.c - cooperative caching between proxy instances. Every instance is
+ *          started with the same member list, so they all build the same
+ *          consistent-hash ring and agree on which member owns a URL. A miss
+ *          for a URL owned by another member is fetched through that member,
+ *          which caches it; a background thread probes the other members and
+ *          lookups skip members that are down, falling back along the ring.
+ */
+
+#include "peer.h"
+
+typedef struct vnode {
+    unsigned long long hash;
+    peer *member;
+} vnode;
+
+/*Global variables*/
+static peer members[MAX_PEERS];
+static int member_count;
+static vnode ring[MAX_PEERS * PEER_VNODES];
+static int ring_size;
+
+static unsigned long long fnv1a(const char *str, unsigned long long hash);
+static unsigned long long mix(unsigned long long hash);
+static int cmp_vnode(const void *a, const void *b);
+static void resolve_member(peer *p);
+static void *health_thread(void *vargp);
+
+/*
+ * peer_add - Add a member given as host:port. Returns -1 if the name is
+ *            malformed or the member table is full.
+ */
+int peer_add(char *name, int is_self)
+{
+    peer *p;
+    char *port_ptr;
+
+    if(member_count == MAX_PEERS || (port_ptr = strrchr(name, ':')) == NULL)
+        return -1;
+
+    p = &members[member_count++];
+    strncpy(p->name, name, MAXLINE - 1);
+    strncpy(p->host, name, port_ptr - name);
+    p->port = atoi(port_ptr + 1);
+    p->is_self = is_self;
+    p->healthy = 1;
+    return 0;
+}
+
+/*
+ * peer_start - Build the hash ring from the members added so far and start
+ *              the health checker. Does nothing without other members.
+ */
+void peer_start(void)
+{
+    char label[MAXLINE + 16];
+    pthread_t tid;
+    int i, v;
+
+    if(!peer_enabled())
+        return;
+
+    for(i = 0; i < member_count; i++) {
+        if(!members[i].is_self)
+            resolve_member(&members[i]);
+        for(v = 0; v < PEER_VNODES; v++) {
+            sprintf(label, "%s#%d", members[i].name, v);
+            ring[ring_size].hash = mix(fnv1a(label, 0xcbf29ce484222325ULL));
+            ring[ring_size].member = &members[i];
+            ring_size++;
+        }
+    }
+    qsort(ring, ring_size, sizeof(vnode), cmp_vnode);
+
+    Pthread_create(&tid, NULL, health_thread, NULL);
+    Pthread_detach(tid);
+}
+
+/*Peering needs ourselves plus at least one other member*/
+int peer_enabled(void)
+{
+    return member_count > 1 && peer_self() != NULL;
+}
+
+peer *peer_self(void)
+{
+    int i;
+
+    for(i = 0; i < member_count; i++) {
+        if(members[i].is_self)
+            return &members[i];
+    }
+    return NULL;
+}
+
+/*
+ * peer_owner - Return the member that should fetch and cache this URL, or
+ *              NULL if that is us. Members that are down are skipped by
+ *              continuing clockwise around the ring.
+ */
+peer *peer_owner(char *hostname, int port, char *uri)
+{
+    char port_str[16];
+    unsigned long long hash;
+    int lo = 0, hi = ring_size, mid, i;
+    peer *p;
+
+    if(!peer_enabled())
+        return NULL;
+
+    sprintf(port_str, ":%d", port);
+    hash = fnv1a(hostname, 0xcbf29ce484222325ULL);
+    hash = fnv1a(port_str, hash);
+    hash = mix(fnv1a(uri, hash));
+
+    /*First virtual node at or after the hash, wrapping around*/
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if(ring[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for(i = 0; i < ring_size; i++) {
+        p = ring[(lo + i) % ring_size].member;
+        if(p->is_self)
+            return NULL;
+        if(__atomic_load_n(&p->healthy, __ATOMIC_RELAXED))
+            return p;
+    }
+    return NULL;
+}
+
+/*
+ * peer_verify - Return the other member a request marked with PEER_HEADER
+ *               came from, or NULL. The header must name a member and the
+ *               connection must come from one of its addresses; anybody
+ *               else sending the header is an ordinary client.
+ */
+peer *peer_verify(char *name, struct in_addr addr)
+{
+    int i, j;
+
+    if(!peer_enabled())
+        return NULL;
+
+    for(i = 0; i < member_count; i++) {
+        if(members[i].is_self || strcmp(members[i].name, name))
+            continue;
+        for(j = 0; j < members[i].addr_count; j++) {
+            if(members[i].addrs[j].s_addr == addr.s_addr)
+                return &members[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * peer_mark_down - A member we could not reach stays out of the ring until
+ *                  the health checker sees it again
+ */
+void peer_mark_down(peer *p)
+{
+    __atomic_store_n(&p->healthy, 0, __ATOMIC_RELAXED);
+}
+
+/*Probe every other member with a TCP connect*/
+static void *health_thread(void *vargp)
+{
+    int i, fd;
+
+    while(1) {
+        for(i = 0; i < member_count; i++) {
+            if(members[i].is_self)
+                continue;
+            fd = open_clientfd_r(members[i].host, members[i].port);
+            __atomic_store_n(&members[i].healthy, fd >= 0, __ATOMIC_RELAXED);
+            if(fd >= 0)
+                close(fd);
+        }
+        sleep(PEER_CHECK_INTERVAL);
+    }
+    return NULL;
+}
+
+/*Resolve a member's host into its addresses; one that does not resolve has none*/
+static void resolve_member(peer *p)
+{
+    struct addrinfo hints, *list, *ai;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(p->host, NULL, &hints, &list) != 0)
+        return;
+    for(ai = list; ai && p->addr_count < PEER_MAX_ADDRS; ai = ai->ai_next)
+        p->addrs[p->addr_count++] = ((struct sockaddr_in*)ai->ai_addr)->sin_addr;
+    freeaddrinfo(list);
+}
+
+static unsigned long long fnv1a(const char *str, unsigned long long hash)
+{
+    while(*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*FNV-1a barely changes the high bits for a different last byte; spread them*/
+static unsigned long long mix(unsigned long long hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static int cmp_vnode(const void *a, const void *b)
+{
+    unsigned long long x = ((const vnode*)a)->hash, y = ((const vnode*)b)->hash;
+    return (x > y) - (x < y);
+}
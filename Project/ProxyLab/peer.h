@@ -0,0 +1,30 @@
+#include "csapp.h"
+
+#define MAX_PEERS 16
+/* Virtual nodes per member on the hash ring */
+#define PEER_VNODES 64
+/* Seconds between health checks */
+#define PEER_CHECK_INTERVAL 2
+/* Request header marking a request forwarded by another peer */
+#define PEER_HEADER "X-Proxy-Peer"
+/* Addresses kept for each member, to tell its requests from a client's */
+#define PEER_MAX_ADDRS 8
+
+typedef struct peer {
+    char name[MAXLINE];     /* "host:port", identical on every instance */
+    char host[MAXLINE];
+    int port;
+    int is_self;
+    int healthy;            /* updated by the health checker */
+    struct in_addr addrs[PEER_MAX_ADDRS];   /* what host resolved to at start */
+    int addr_count;
+} peer;
+
+/*Function prototypes*/
+int peer_add(char *name, int is_self);
+void peer_start(void);
+int peer_enabled(void);
+peer *peer_self(void);
+peer *peer_owner(char *hostname, int port, char *uri);
+peer *peer_verify(char *name, struct in_addr addr);
+void peer_mark_down(peer *p);
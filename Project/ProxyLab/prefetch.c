@@ -0,0 +1,201 @@
+/*
+ * Name: Chih-Feng Lin
+         Chi-Heng Wu
+ * Andrew ID: chihfenl
+              chihengw
+
+ *
+ * prefetch.c - finds the resources an HTML page embeds, which the browser
+ *              will ask for right after the page: <img src>, <script src>
+ *              and <link href> for stylesheets, icons and preloads. Only
+ *              same-origin URLs are returned, as origin-relative paths, so
+ *              the proxy can warm them into its cache before they are
+ *              requested. This is a tolerant tag scanner, not a parser: it
+ *              knows nothing of comments or script bodies and skips what it
+ *              does not understand.
+ */
+
+#define _GNU_SOURCE
+#include "prefetch.h"
+
+static const unsigned char *scan_tag(const unsigned char *p, const unsigned char *end,
+                                     char *url, size_t url_max);
+static int resolve(char *hostname, int port, char *page_uri, char *url, char *uri);
+static int tag_is(const unsigned char *p, const unsigned char *end, const char *name);
+
+/*
+ * prefetch_extract - Store up to max distinct same-origin resource paths
+ *                    embedded in html, a page served as page_uri from
+ *                    hostname:port. Returns how many were stored.
+ */
+int prefetch_extract(char *hostname, int port, char *page_uri,
+                     unsigned char *html, size_t size, char uris[][MAXLINE], int max)
+{
+    const unsigned char *p = html, *end = html + size;
+    char url[MAXLINE];
+    int n = 0, i, seen;
+
+    while(n < max && p < end && (p = memchr(p, '<', end - p)) != NULL) {
+        p = scan_tag(p + 1, end, url, MAXLINE);
+        if(url[0] == '\0' || resolve(hostname, port, page_uri, url, uris[n]) < 0)
+            continue;
+
+        for(seen = 0, i = 0; i < n && !seen; i++)
+            seen = !strcmp(uris[i], uris[n]);
+        if(!seen)
+            n++;
+    }
+    return n;
+}
+
+/*
+ * Read one tag starting after its '<'. If it embeds a resource, its URL is
+ * left in url, otherwise url is empty. Returns where scanning continues.
+ */
+static const unsigned char *scan_tag(const unsigned char *p, const unsigned char *end,
+                                     char *url, size_t url_max)
+{
+    const char *wanted;
+    const unsigned char *name, *value;
+    size_t name_len, value_len;
+    char rel[64] = "";
+    int is_link = 0;
+    unsigned char quote;
+
+    url[0] = '\0';
+    if(tag_is(p, end, "img") || tag_is(p, end, "script")) {
+        wanted = "src";
+    } else if(tag_is(p, end, "link")) {
+        wanted = "href";
+        is_link = 1;
+    } else {
+        return p;
+    }
+
+    /*Walk the attributes up to '>'*/
+    while(p < end && !isspace(*p) && *p != '>')
+        p++;
+    while(p < end && *p != '>') {
+        while(p < end && (isspace(*p) || *p == '/'))
+            p++;
+        name = p;
+        while(p < end && !isspace(*p) && *p != '=' && *p != '>')
+            p++;
+        name_len = p - name;
+        while(p < end && isspace(*p))
+            p++;
+        if(p >= end || *p != '=')
+            continue;
+        p++;
+        while(p < end && isspace(*p))
+            p++;
+
+        if(p < end && (*p == '"' || *p == '\'')) {
+            quote = *p++;
+            value = p;
+            while(p < end && *p != quote)
+                p++;
+            value_len = p - value;
+            if(p < end)
+                p++;
+        } else {
+            value = p;
+            while(p < end && !isspace(*p) && *p != '>')
+                p++;
+            value_len = p - value;
+        }
+
+        if(name_len == strlen(wanted) && !strncasecmp((char*)name, wanted, name_len) &&
+                value_len < url_max) {
+            memcpy(url, value, value_len);
+            url[value_len] = '\0';
+        } else if(is_link && name_len == 3 && !strncasecmp((char*)name, "rel", 3) &&
+                value_len < sizeof(rel)) {
+            memcpy(rel, value, value_len);
+            rel[value_len] = '\0';
+        }
+    }
+
+    /*A <link> is embedded only if it is a stylesheet, an icon or a preload*/
+    if(is_link && !strcasestr(rel, "stylesheet") && !strcasestr(rel, "icon") &&
+            !strcasestr(rel, "preload"))
+        url[0] = '\0';
+    return p;
+}
+
+/*Does the tag at p have this name?*/
+static int tag_is(const unsigned char *p, const unsigned char *end, const char *name)
+{
+    size_t len = strlen(name);
+
+    return end - p > len && !strncasecmp((char*)p, name, len) &&
+           (isspace(p[len]) || p[len] == '>' || p[len] == '/');
+}
+
+/*
+ * Turn a URL found in the page into an origin-relative path in uri.
+ * Returns -1 for URLs on another origin or that are not fetchable.
+ */
+static int resolve(char *hostname, int port, char *page_uri, char *url, char *uri)
+{
+    char host[MAXLINE], *src, *dst, *path, *port_ptr, *last_slash;
+    int url_port = 80;
+    size_t len;
+
+    /*Undo the one entity that is common inside attribute values*/
+    for(src = dst = url; *src; ) {
+        if(!strncmp(src, "&amp;", 5)) {
+            *dst++ = '&';
+            src += 5;
+        } else {
+            *dst++ = *src++;
+        }
+    }
+    *dst = '\0';
+    if((dst = strchr(url, '#')) != NULL)
+        *dst = '\0';
+    if(url[0] == '\0')
+        return -1;
+
+    if(!strncasecmp(url, "http://", 7) || !strncmp(url, "//", 2)) {
+        src = url + (url[0] == '/' ? 2 : 7);
+        path = strchr(src, '/');
+        len = path ? (size_t)(path - src) : strlen(src);
+        if(len == 0 || len >= MAXLINE)
+            return -1;
+        memcpy(host, src, len);
+        host[len] = '\0';
+        if((port_ptr = strchr(host, ':')) != NULL) {
+            *port_ptr = '\0';
+            url_port = atoi(port_ptr + 1);
+        }
+        if(strcasecmp(host, hostname) || url_port != port)
+            return -1;
+        strcpy(uri, path ? path : "/");
+        return 0;
+    }
+
+    /*Any other scheme (https:, data:, javascript:, ...) is not ours*/
+    for(src = url; isalnum((unsigned char)*src) || *src == '+' || *src == '-' || *src == '.'; src++)
+        ;
+    if(*src == ':')
+        return -1;
+
+    if(url[0] == '/') {
+        strcpy(uri, url);
+        return 0;
+    }
+
+    /*Relative to the directory of the page*/
+    len = strcspn(page_uri, "?");
+    last_slash = memrchr(page_uri, '/', len);
+    len = last_slash ? (size_t)(last_slash - page_uri) + 1 : 0;
+    if(len + strlen(url) + 1 >= MAXLINE)
+        return -1;
+    if(len == 0)
+        uri[len++] = '/';
+    else
+        memcpy(uri, page_uri, len);
+    strcpy(uri + len, url);
+    return 0;
+}
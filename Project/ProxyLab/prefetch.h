@@ -0,0 +1,11 @@
+#include "csapp.h"
+
+/* Embedded resources warmed per page, and prefetches allowed to wait */
+#define PREFETCH_PER_PAGE 16
+#define PREFETCH_QUEUE_MAX 64
+/* Scheduling niceness of the prefetch workers */
+#define PREFETCH_NICE 10
+
+/*Function prototypes*/
+int prefetch_extract(char *hostname, int port, char *page_uri,
+                     unsigned char *html, size_t size, char uris[][MAXLINE], int max);
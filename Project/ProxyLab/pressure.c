@@ -0,0 +1,171 @@
+/*
+ * Name: Chih-Feng Lin
+         Chi-Heng Wu
+ * Andrew ID: chihfenl
+              chihengw
+
+ *
+ * pressure.c - adapts the cache budget to the memory pressure of the host
+ *              or container. A thread samples Linux pressure stall
+ *              information (/proc/pressure/memory) and the usage of our
+ *              memory cgroup against its limit (cgroup v2 memory.current
+ *              and memory.max, or the v1 equivalents). Under pressure the
+ *              budget shrinks step by step, which evicts at once; when the
+ *              pressure is gone it grows back towards the configured size.
+ */
+
+#include "pressure.h"
+#include "cache.h"
+
+/* A cgroup v1 limit this large means there is none */
+#define CGROUP_UNLIMITED (1ULL << 60)
+
+typedef struct pressure_state {
+    cache_list *cache;
+    size_t min_budget, max_budget;
+    char usage_path[MAXLINE], limit_path[MAXLINE];
+} pressure_state;
+
+static void *pressure_thread(void *vargp);
+static double read_psi(void);
+static int find_cgroup(pressure_state *ps);
+static unsigned long long read_number(char *path);
+
+/*
+ * pressure_start - Keep the budget of cache between min_budget and
+ *                  max_budget according to memory pressure. Returns -1,
+ *                  leaving the budget alone, if this system reports
+ *                  neither PSI nor a cgroup memory limit.
+ */
+int pressure_start(cache_list *cache, size_t min_budget, size_t max_budget)
+{
+    pressure_state *ps = (pressure_state*)Calloc(1, sizeof(pressure_state));
+    pthread_t tid;
+
+    ps->cache = cache;
+    ps->min_budget = min_budget;
+    ps->max_budget = max_budget;
+    if(find_cgroup(ps) < 0 && read_psi() < 0) {
+        free(ps);
+        return -1;
+    }
+    Pthread_create(&tid, NULL, pressure_thread, ps);
+    return 0;
+}
+
+static void *pressure_thread(void *vargp)
+{
+    pressure_state *ps = (pressure_state*)vargp;
+    unsigned long long usage, limit;
+    size_t budget, next;
+    double psi;
+    int high, low;
+
+    Pthread_detach(Pthread_self());
+    while(1) {
+        sleep(PRESSURE_INTERVAL);
+
+        /*Either signal alone is enough to shrink, growing needs both quiet*/
+        psi = read_psi();
+        high = (psi >= PRESSURE_PSI_HIGH);
+        low = (psi < PRESSURE_PSI_LOW);
+        if(ps->limit_path[0] != '\0' && (limit = read_number(ps->limit_path)) > 0 &&
+                limit < CGROUP_UNLIMITED) {
+            usage = read_number(ps->usage_path);
+            high |= (usage * 100 >= limit * PRESSURE_CGROUP_HIGH);
+            low &= (usage * 100 < limit * PRESSURE_CGROUP_LOW);
+        }
+
+        budget = next = ps->cache->budget;
+        if(high) {
+            next = budget - budget / PRESSURE_SHRINK_DIV;
+            if(next < ps->min_budget)
+                next = ps->min_budget;
+        } else if(low) {
+            next = budget + budget / PRESSURE_GROW_DIV;
+            if(next > ps->max_budget)
+                next = ps->max_budget;
+        }
+        if(next != budget) {
+            cache_set_budget(ps->cache, next);
+            fprintf(stderr, "pressure: cache budget %lu -> %lu bytes\n",
+                    (unsigned long)budget, (unsigned long)next);
+        }
+    }
+    return NULL;
+}
+
+/*The share of the last 10s some task stalled on memory, -1 if unknown*/
+static double read_psi(void)
+{
+    FILE *fp;
+    double avg10;
+
+    if((fp = fopen("/proc/pressure/memory", "r")) == NULL)
+        return -1;
+    if(fscanf(fp, "some avg10=%lf", &avg10) != 1)
+        avg10 = -1;
+    fclose(fp);
+    return avg10;
+}
+
+/*
+ * Find the usage and limit files of our memory cgroup, as the unified (v2)
+ * hierarchy or the v1 memory controller. Inside a cgroup namespace the
+ * path in /proc/self/cgroup may not exist under the mount, so the mount
+ * point itself is tried as well. Returns -1 if there is no limit file.
+ */
+static int find_cgroup(pressure_state *ps)
+{
+    char line[MAXLINE], *path, *base;
+    const char *usage_name, *limit_name;
+    FILE *fp;
+    int found = 0;
+
+    if((fp = fopen("/proc/self/cgroup", "r")) == NULL)
+        return -1;
+    while(!found && fgets(line, MAXLINE, fp) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if(!strncmp(line, "0::", 3)) {
+            path = line + 3;
+            base = "/sys/fs/cgroup";
+            usage_name = "memory.current";
+            limit_name = "memory.max";
+        } else if((path = strstr(line, ":memory:")) != NULL) {
+            path += 8;
+            base = "/sys/fs/cgroup/memory";
+            usage_name = "memory.usage_in_bytes";
+            limit_name = "memory.limit_in_bytes";
+        } else {
+            continue;
+        }
+
+        sprintf(ps->limit_path, "%s%s/%s", base, path, limit_name);
+        if(access(ps->limit_path, R_OK) < 0)
+            path = "";
+        sprintf(ps->limit_path, "%s%s/%s", base, path, limit_name);
+        sprintf(ps->usage_path, "%s%s/%s", base, path, usage_name);
+        found = (access(ps->limit_path, R_OK) == 0 && access(ps->usage_path, R_OK) == 0);
+    }
+    fclose(fp);
+
+    if(!found) {
+        ps->limit_path[0] = '\0';
+        return -1;
+    }
+    return 0;
+}
+
+/*The number in a cgroup file; 0 for "max", unreadable or empty files*/
+static unsigned long long read_number(char *path)
+{
+    FILE *fp;
+    unsigned long long n = 0;
+
+    if((fp = fopen(path, "r")) == NULL)
+        return 0;
+    if(fscanf(fp, "%llu", &n) != 1)
+        n = 0;
+    fclose(fp);
+    return n;
+}
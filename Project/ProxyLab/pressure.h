@@ -0,0 +1,18 @@
+#include "csapp.h"
+
+struct cache_list;
+
+/* Seconds between looks at the memory pressure */
+#define PRESSURE_INTERVAL 2
+/* PSI "some avg10" percentages that shrink the cache, or let it grow back */
+#define PRESSURE_PSI_HIGH 10.0
+#define PRESSURE_PSI_LOW 1.0
+/* Percentages of the cgroup memory limit in use that do the same */
+#define PRESSURE_CGROUP_HIGH 90
+#define PRESSURE_CGROUP_LOW 75
+/* Under pressure the budget drops by a quarter, without it regains an eighth */
+#define PRESSURE_SHRINK_DIV 4
+#define PRESSURE_GROW_DIV 8
+
+/*Function prototypes*/
+int pressure_start(struct cache_list *cache, size_t min_budget, size_t max_budget);
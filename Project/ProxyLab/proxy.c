@@ -8,12 +8,72 @@
 */
 
 #include <stdio.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include "csapp.h"
 #include "cache.h"
+#include "tunnel.h"
+#include "http.h"
+#include "accesslog.h"
+#include "peer.h"
+#include "sched.h"
+#include "urlnorm.h"
+#include "timer.h"
+#include "workq.h"
+#include "restart.h"
+#include "prefetch.h"
+#include "pressure.h"
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+/*
+ * With -a the cache budget follows memory pressure, between the size given
+ * with -C (DEFAULT_CACHE_SIZE without it) and this fraction of it
+ */
+#define MIN_CACHE_DIV 8
+
+/* Per-request buffer decoupling origin download from client delivery */
+#define RELAY_BUF_SIZE MAX_OBJECT_SIZE
+
+/*
+ * Worker threads in the hit lane, which read requests and answer cache hits,
+ * and in the miss lane, which fetches from peers and origins (-w and -m).
+ * Misses beyond MISS_QUEUE_MAX waiting for the miss lane are refused.
+ */
+#define DEFAULT_WORKERS 32
+#define DEFAULT_MISS_WORKERS 32
+#define MISS_QUEUE_MAX 1024
+
+/*
+ * Misses forwarded to us by cache peers have a lane of their own, so they
+ * never wait behind our own misses that are waiting on those very peers
+ */
+#define DEFAULT_PEER_WORKERS 8
+
+/* CONNECT tunnels run in threads of their own, at most this many at once */
+#define MAX_TUNNELS 256
+
+/* How often a process that handed over its listener checks for idleness */
+#define DRAIN_POLL_USEC 100000
+
+/* Statuses that can have a negative-cache TTL; slot 0 is "connect failed" */
+#define MAX_STATUS 600
+#define NEGATIVE_CONNECT 0
+
+/* Origins remembered as unreachable; a newer failure takes an older one's slot */
+#define ORIGIN_DOWN_SLOTS 64
+
+/*
+ * Connection deadlines, settable with -T. Connect bounds an origin connect;
+ * idle bounds the wait for a client's request line, header the rest of its
+ * request; body bounds each stall while a response is moving either way.
+ */
+typedef enum {
+    TIMEOUT_CONNECT,
+    TIMEOUT_IDLE,
+    TIMEOUT_HEADER,
+    TIMEOUT_BODY,
+    TIMEOUT_COUNT
+} timeout_kind;
 
 /* You won't lose style points for including these long lines in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
@@ -21,19 +81,131 @@ static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,applica
 static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
 
 
+/* Client request headers the proxy acts on rather than just forwards */
+typedef struct request_info {
+    int from_peer;          /* sent by a cache peer that expects us to fetch */
+    char peer[MAXLINE];     /* PEER_HEADER value, empty if none */
+    char range[MAXLINE];    /* Range value, empty if the whole object is wanted */
+    char if_range[MAXLINE]; /* If-Range validator, empty if none */
+} request_info;
+
+/* A cache miss handed from the hit lane to the miss lane */
+typedef struct miss_job {
+    workq_item item;
+    int fd;
+    struct in_addr client;
+    char request_header[MAXLINE];
+    char hostname[MAXLINE], uri[MAXLINE], key_uri[MAXLINE];
+    int port;
+    request_info info;
+    access_record rec;
+} miss_job;
+
+/* A CONNECT request taken off the worker pool for the life of its tunnel */
+typedef struct tunnel_job {
+    int fd;
+    rio_t rio;              /* holds whatever the client sent past its header */
+    char authority[MAXLINE];
+    access_record rec;
+} tunnel_job;
+
+/* An object being fetched into the cache with no client waiting for it */
+typedef struct pending_fetch {
+    char hostname[MAXLINE];
+    int port;
+    char key_uri[MAXLINE];
+    struct pending_fetch *next;
+} pending_fetch;
+
+/* An origin whose connect failed, and until when it is not tried again */
+typedef struct origin_down {
+    char hostname[MAXLINE];
+    int port;
+    time_t until;
+} origin_down;
+
 /* Function prototypes */
 void sigpipe_handler(int sig);
-void *thread(void *vargp);
-void do_transaction(int fd);
+void *worker(void *vargp);
+void *miss_worker(void *vargp);
+void *prefetch_worker(void *vargp);
+void *tunnel_thread(void *vargp);
+void *stats_thread(void *vargp);
+void usage(char *prog);
+int do_transaction(int fd, struct in_addr client, int *exempt);
+void do_miss(miss_job *job);
+int start_tunnel(int fd, struct in_addr client, rio_t *rio, char *authority,
+                 access_record *rec);
+int serve_range(int fd, char *stored, size_t header_size, unsigned char *body,
+                size_t body_size, request_info *info, access_record *rec);
+int start_background_fetch(workq *queue, char *hostname, int port, char *key_uri,
+                           char *request_header);
+void prefetch_page(char *hostname, int port, char *page_uri, unsigned char *html, size_t size);
+void finish_background_fetch(miss_job *job);
+void do_tunnel(int fd, rio_t *rio, char *authority, access_record *rec);
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
+void build_error(char *header, char *body, char *cause, char *errnum, char *shortmsg,
+                 char *longmsg);
+int set_negative_ttl(char *spec);
+int set_timeout(char *spec);
+int open_origin(char *hostname, int port);
+int origin_is_down(char *hostname, int port);
+void origin_mark_down(char *hostname, int port);
+unsigned int origin_slot(char *hostname, int port);
+void close_origin(int fd);
+time_t cache_expiry(int status);
 void parse_request_url(char *url, char *hostname, int *port, char *uri);
-void make_request_info(rio_t *rio, char *request_header, char *method, char *hostname, char *uri);
-void request_to_server(char *hostname, char *uri, int port, int client_fd, char* request_header);
-int check_object_size(size_t *object_size, size_t read_num, unsigned char *object_data, unsigned char *buf);
+void make_request_info(rio_t *rio, char *request_header, char *method, char *hostname, char *uri,
+                       request_info *info);
+void make_background_request(char *request_header, char *hostname, int port, char *uri);
+void add_proxy_headers(char *request_header);
+void request_to_server(char *hostname, char *key_uri, int port, int client_fd, char* request_header,
+                       int cacheable, access_record *rec);
+int fetch_from_peer(peer *owner, char *hostname, char *uri, int port, int client_fd,
+                    char *request_header, access_record *rec);
+int relay_response(int server_fd, int client_fd, char *hostname, int port, char *uri,
+                   int cacheable, access_record *rec);
+ssize_t relay_pending(int fd, char *header, size_t header_size, unsigned char *body,
+                      size_t body_size, size_t sent, int more, int block);
 
 /*Global variables*/
 cache_list *cache;
 
+/* Cache misses waiting for the miss lane, and those peers sent us for theirs */
+workq miss_queue;
+workq peer_queue;
+
+/* CONNECT tunnels open */
+int tunnels = 0;
+
+/* Embedded resources waiting to be prefetched, when -p enabled prefetching */
+workq prefetch_queue;
+int prefetch_enabled = 0;
+
+/* Connections accepted and not yet closed, for draining on hot restart */
+int inflight = 0;
+
+/* Background fetches under way, so each object is fetched only once */
+pending_fetch *pending_fetches = NULL;
+pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Seconds a failure stays in the cache, by status; 0 means not cached */
+int negative_ttl[MAX_STATUS];
+
+/* Origins that failed to connect, for negative_ttl[NEGATIVE_CONNECT] seconds */
+origin_down down_origins[ORIGIN_DOWN_SLOTS];
+pthread_mutex_t down_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Store textual bodies compressed in the cache (-z) */
+int compress_cache = 0;
+
+/* Milliseconds per timeout_kind; 0 disables that deadline */
+static const char *timeout_names[TIMEOUT_COUNT] = {"connect", "idle", "header", "body"};
+int timeout_ms[TIMEOUT_COUNT] = {5000, 30000, 10000, 30000};
+
+/* Deadlines on the client and the upstream connection of this thread's request */
+static __thread conn_timer client_timer, server_timer;
+
 
 /*
 *  When socket has been broken, kernel will send SIGPIPE to process.
@@ -52,100 +224,846 @@ void sigpipe_handler(int sig)
 int main(int argc, char **argv)
 {
 
-    int listenfd, *connfdp, port;
+    int listenfd, port, opt, connfd, i;
+    int workers = DEFAULT_WORKERS, miss_workers = DEFAULT_MISS_WORKERS, prefetch_workers = 0;
     socklen_t clientlen = sizeof(struct sockaddr_in);
     struct sockaddr_in clientaddr;
     pthread_t tid;
+    char *access_log_path = NULL, *self_name = NULL, *restart_path = NULL;
+    int drain_pipe[2] = {-1, -1}, adapt_cache = 0;
+    size_t cache_size = DEFAULT_CACHE_SIZE;
+    struct pollfd pfds[2];
+    char default_self[MAXLINE];
+    sched_limits limits = {0, 0, 64, 0};
+    sigset_t mask;
 
     /*Install SIGPIPE handler to prevent process terminal*/
     Signal(SIGPIPE, sigpipe_handler);
 
-    if(argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(0);
+    /*Outages are answered from the cache for a few seconds, missing pages longer*/
+    set_negative_ttl("connect=10");
+    set_negative_ttl("404=60");
+    set_negative_ttl("410=60");
+    set_negative_ttl("500=10");
+    set_negative_ttl("502=10");
+    set_negative_ttl("503=10");
+    set_negative_ttl("504=10");
+
+    while((opt = getopt(argc, argv, "l:P:I:w:m:p:r:b:q:c:n:N:T:zH:C:a")) != -1) {
+        switch(opt) {
+        case 'C':
+            cache_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'a':
+            adapt_cache = 1;
+            break;
+        case 'p':
+            prefetch_workers = atoi(optarg);
+            break;
+        case 'H':
+            restart_path = optarg;
+            break;
+        case 'm':
+            miss_workers = atoi(optarg);
+            break;
+        case 'z':
+            compress_cache = 1;
+            break;
+        case 'T':
+            if(set_timeout(optarg) < 0)
+                usage(argv[0]);
+            break;
+        case 'N':
+            if(set_negative_ttl(optarg) < 0)
+                usage(argv[0]);
+            break;
+        case 'n':
+            if(urlnorm_load_rules(optarg) < 0)
+                unix_error("Cannot load URL rules");
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'r':
+            limits.rate = atof(optarg);
+            break;
+        case 'b':
+            limits.burst = atoi(optarg);
+            break;
+        case 'q':
+            limits.max_queued = atoi(optarg);
+            break;
+        case 'c':
+            limits.max_active = atoi(optarg);
+            break;
+        case 'l':
+            access_log_path = optarg;
+            break;
+        case 'P':
+            if(peer_add(optarg, 0) < 0)
+                usage(argv[0]);
+            break;
+        case 'I':
+            self_name = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1 || workers < 1 || miss_workers < 1 || cache_size < MAX_OBJECT_SIZE) {
+        usage(argv[0]);
+    }
+
+    /*By default no single client may hold more than half of the workers*/
+    if(limits.max_active == 0)
+        limits.max_active = (workers + miss_workers + 1) / 2;
+    if(limits.rate > 0 && limits.burst == 0)
+        limits.burst = (int)limits.rate + 1;
+
+    /*SIGUSR1 is taken by stats_thread only; block it before any thread starts*/
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    /*Start the access log before any worker can produce records*/
+    if(access_log_path != NULL && access_log_init(access_log_path) < 0) {
+        unix_error("Cannot open access log");
     }
 
     /*Set listening port and initialize web cache*/
     cache = (cache_list*)Calloc(1, sizeof(cache_list));
     cache->total_cache_size = 0;
     cache->head = NULL;
+    cache->budget = cache_size;
     initialize_cache();
-    port = atoi(argv[1]);
-    listenfd = Open_listenfd(port);
+    port = atoi(argv[optind]);
+
+    /*
+     * With -H, take over the listener and cache of a proxy already serving
+     * there, if any, and wait for our own successor in turn. The listener may
+     * then be shared with another process, so it must never block in accept.
+     */
+    if(restart_path == NULL || (listenfd = restart_takeover(restart_path, cache)) < 0)
+        listenfd = Open_listenfd(port);
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    if(restart_path != NULL) {
+        if(pipe(drain_pipe) < 0)
+            unix_error("pipe error");
+        restart_listen(restart_path, listenfd, cache, drain_pipe[1]);
+    }
+
+    /*Join the peer group under the name the other members know us by*/
+    if(self_name == NULL) {
+        sprintf(default_self, "127.0.0.1:%d", port);
+        self_name = default_self;
+    }
+    if(peer_add(self_name, 1) < 0)
+        usage(argv[0]);
+    peer_start();
+    timer_init();
+    if(adapt_cache && pressure_start(cache, cache_size / MIN_CACHE_DIV, cache_size) < 0)
+        fprintf(stderr, "pressure: no memory pressure information, cache stays fixed\n");
 
-    /*Here I use straightforward method to spawn a new worker thread for each request*/
+    /*
+     * A fixed pool of workers takes connections from the fair scheduler, which
+     * the acceptor below fills. A client over its queue limit is turned away.
+     * Those workers serve hits themselves and pass misses to a second pool, so
+     * a slow origin never holds up a request the cache can answer.
+     */
+    sched_init(&limits);
+    workq_init(&miss_queue, "miss lane", MISS_QUEUE_MAX);
+    for(i = 0; i < workers; i++) {
+        Pthread_create(&tid, NULL, worker, NULL);
+    }
+    for(i = 0; i < miss_workers; i++) {
+        Pthread_create(&tid, NULL, miss_worker, &miss_queue);
+    }
+    workq_init(&peer_queue, "peer lane", MISS_QUEUE_MAX);
+    if(peer_enabled()) {
+        for(i = 0; i < DEFAULT_PEER_WORKERS; i++) {
+            Pthread_create(&tid, NULL, miss_worker, &peer_queue);
+        }
+    }
+
+    /*Prefetching runs in a small pool of its own, below everything else*/
+    if(prefetch_workers > 0) {
+        workq_init(&prefetch_queue, "prefetch", PREFETCH_QUEUE_MAX);
+        prefetch_enabled = 1;
+        for(i = 0; i < prefetch_workers; i++) {
+            Pthread_create(&tid, NULL, prefetch_worker, NULL);
+        }
+    }
+    Pthread_create(&tid, NULL, stats_thread, NULL);
+
+    pfds[0].fd = listenfd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = drain_pipe[0];
+    pfds[1].events = POLLIN;
     while(1) {
-		int counter = 0;
-		while ((connfdp = (int*)Calloc(1, sizeof(int))) == NULL) {
-        	if(counter > 10)
-				break;
-			counter++;
-			sleep(1);
-		}
-		//connfdp = (int*)Calloc(1, sizeof(int));
-        *connfdp = Accept(listenfd, (SA*) &clientaddr, &clientlen);
-        Pthread_create(&tid, NULL, thread, connfdp);
+        if(poll(pfds, 2, -1) < 0) {
+            if(errno == EINTR)
+                continue;
+            unix_error("poll error");
+        }
+
+        /*A successor has our listener; stop accepting*/
+        if(pfds[1].revents)
+            break;
+
+        /*Another process sharing the listener may have taken the connection*/
+        if((connfd = accept(listenfd, (SA*) &clientaddr, &clientlen)) < 0)
+            continue;
+        __atomic_add_fetch(&inflight, 1, __ATOMIC_RELAXED);
+        if(sched_submit(connfd, clientaddr.sin_addr) < 0) {
+            clienterror(connfd, inet_ntoa(clientaddr.sin_addr), "503", "Service Unavailable",
+                        "Too many pending requests from");
+            Close(connfd);
+            __atomic_sub_fetch(&inflight, 1, __ATOMIC_RELAXED);
+        }
     }
 
-    return 0;
+    /*Finish every request we accepted, let the logger catch up, and leave*/
+    Close(listenfd);
+    while(__atomic_load_n(&inflight, __ATOMIC_RELAXED) > 0)
+        usleep(DRAIN_POLL_USEC);
+    usleep(2 * LOG_IDLE_USEC);
+    exit(0);
+}
+
+/*
+* worker - Serve connections handed out by the scheduler, forever. A
+*          connection passed on to the miss lane is closed there.
+*/
+void *worker(void *vargp)
+{
+    sched_conn conn;
+    int exempt;
+
+    Pthread_detach(Pthread_self());
+    while(1) {
+        sched_next(&conn);
+        timer_arm(&client_timer, conn.fd, timeout_ms[TIMEOUT_IDLE]);
+        exempt = 0;
+        if(do_transaction(conn.fd, conn.client, &exempt))
+            continue;
+        timer_cancel(&client_timer);
+        Close(conn.fd);
+        if(!exempt)
+            sched_done(conn.client);
+        __atomic_sub_fetch(&inflight, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/*
+* miss_worker - Fetch the misses queued on the workq vargp, forever
+*/
+void *miss_worker(void *vargp)
+{
+    workq *queue = (workq*)vargp;
+    miss_job *job;
+
+    Pthread_detach(Pthread_self());
+    while(1) {
+        job = (miss_job*)workq_pop(queue);
+        do_miss(job);
+        if(job->fd >= 0) {
+            timer_cancel(&client_timer);
+            Close(job->fd);
+            if(!job->info.from_peer)
+                sched_done(job->client);
+            __atomic_sub_fetch(&inflight, 1, __ATOMIC_RELAXED);
+        }
+        free(job);
+    }
+    return NULL;
+}
+
+/*
+* prefetch_worker - A miss worker for the prefetch queue that only gets the
+*                   CPU when the other workers leave some
+*/
+void *prefetch_worker(void *vargp)
+{
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), PREFETCH_NICE);
+    return miss_worker(&prefetch_queue);
 }
 
 /*
-* Thread routine - Use detach function to make spare resources be automatically
-*                  reaped upon thread exit
+* tunnel_thread - Run one CONNECT tunnel to the end and close its connection
 */
-void *thread(void *vargp)
+void *tunnel_thread(void *vargp)
 {
-    int connfd;
-    connfd = *((int*)vargp);
+    tunnel_job *job = (tunnel_job*)vargp;
+
+    Pthread_detach(Pthread_self());
+    timer_arm(&client_timer, job->fd, timeout_ms[TIMEOUT_HEADER]);
+    do_tunnel(job->fd, &job->rio, job->authority, &job->rec);
+    access_log(&job->rec);
+    timer_cancel(&client_timer);
+    Close(job->fd);
+    free(job);
+    __atomic_sub_fetch(&tunnels, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&inflight, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/*
+* stats_thread - Dump the scheduler counters to stderr on every SIGUSR1
+*/
+void *stats_thread(void *vargp)
+{
+    sigset_t mask;
+    int sig;
+
     Pthread_detach(Pthread_self());
-    free(vargp);
-    do_transaction(connfd);
-    Close(connfd);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    while(1) {
+        if(sigwait(&mask, &sig) == 0) {
+            sched_dump_stats(stderr);
+            cache_dump_stats(cache, stderr);
+            workq_dump_stats(&miss_queue, stderr);
+            if(peer_enabled())
+                workq_dump_stats(&peer_queue, stderr);
+            if(prefetch_enabled)
+                workq_dump_stats(&prefetch_queue, stderr);
+        }
+    }
     return NULL;
+}
 
+/*
+* usage - Print the command line synopsis and exit
+*/
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-l access_log] [-P peer_host:port]... [-I self_host:port]\n"
+                    "          [-w hit_workers] [-m miss_workers] [-p prefetch_workers]\n"
+                    "          [-r client_req_per_sec] [-b client_burst]\n"
+                    "          [-q client_max_queued] [-c client_max_active]\n"
+                    "          [-n url_rules] [-N status|connect=ttl_seconds]...\n"
+                    "          [-T connect|idle|header|body=seconds]... [-z]\n"
+                    "          [-H restart_socket] [-C cache_bytes] [-a] <port>\n", prog);
+    exit(0);
 }
 
 /*
-* do_transaction - Send request to web sever and sned the response accepted
-*                  from server back to client
+* do_transaction - Read the client's request and answer it from the cache.
+*                  A miss is queued for the miss lane, which sends the request
+*                  to the web server and the response back to the client.
+*                  Returns 1 if the connection now belongs to the miss lane.
+*                  Sets *exempt if it came from a cache peer and so no longer
+*                  counts against its client's limits.
 */
 
-void do_transaction(int fd)
+int do_transaction(int fd, struct in_addr client, int *exempt)
 {
     char request_header[MAXLINE];
     char buf[MAXLINE], method[MAXLINE], url[MAXLINE], version[MAXLINE];
-    char uri[MAXLINE], hostname[MAXLINE];
+    char uri[MAXLINE], hostname[MAXLINE], key_uri[MAXLINE];
     int port;
     rio_t rio;
     cache_elem *cached_object;
+    unsigned char object[MAX_OBJECT_SIZE];
+    char *stored;
+    unsigned char *body;
+    ssize_t response_size;
+    struct iovec iov[2];
+    access_record rec;
+    request_info info;
+    miss_job *job;
 
+    access_log_begin(&rec, client);
 
     /*Read request line and header from client*/
     Rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf, MAXLINE);  //write the data to the buf
-    sscanf(buf, "%s %s %s", method, url, version); //move buf data respectively to three variables
+    if(rio_readlineb(&rio, buf, MAXLINE) <= 0)  //write the data to the buf
+        return 0;
+    if(sscanf(buf, "%s %s %s", method, url, version) != 3) { //move buf data respectively to three variables
+        clienterror(fd, buf, "400", "Bad Request",
+                        "Proxy could not parse the request line");
+        return 0;
+    }
+    strncpy(rec.url, url, LOG_URL_MAX - 1);
+    timer_arm(&client_timer, fd, timeout_ms[TIMEOUT_HEADER]);
+
+    /*
+     * CONNECT turns this connection into an opaque tunnel, which can last
+     * far longer than any request, so it gets a thread of its own
+     */
+    if(!strcasecmp(method, "CONNECT")) {
+        if(start_tunnel(fd, client, &rio, url, &rec) == 0)
+            return 1;
+        clienterror(fd, url, "503", "Service Unavailable",
+                    "Too many tunnels open to connect to");
+        rec.status = 503;
+        access_log(&rec);
+        return 0;
+    }
 
     /*Set proxy to be able to handle GET request*/
     if(strcasecmp(method, "GET")) {
         clienterror(fd, method, "501", "Not Implemented",
                         "Proxy does not implement this method");
-        return;
+        rec.status = 501;
+        access_log(&rec);
+        return 0;
     }
 
     parse_request_url(url, hostname, &port, uri);
-    make_request_info(&rio, request_header, method, hostname, uri);
+    urlnorm_canonicalize(hostname, uri, key_uri);
+    make_request_info(&rio, request_header, method, hostname, uri, &info);
+
+    /*Only a member, from its own address, may have us fetch for it*/
+    if(info.peer[0] != '\0' && peer_verify(info.peer, client) != NULL) {
+        info.from_peer = 1;
+        sched_exempt(client);
+        *exempt = 1;
+    }
+
+    /*The client stalled before finishing its request; its socket is already shut*/
+    if(timer_fired(&client_timer)) {
+        rec.status = 408;
+        access_log(&rec);
+        return 0;
+    }
+    timer_cancel(&client_timer);
 
-    /*Check whether exists cached object*/
-    cached_object = check_cache_list(cache, hostname, &port, uri);
+    /*Check whether exists cached object, which is ours until released*/
+    cached_object = check_cache_list(cache, hostname, &port, key_uri);
     if (cached_object != NULL) {
         /*If exists, directly send the cached memory as response to client*/
-	rio_writen(fd, cached_object->data, cached_object->size);
-	return;
+        timer_arm(&client_timer, fd, timeout_ms[TIMEOUT_BODY]);
+        rec.outcome = cached_object->expires ? LOG_NEGATIVE_HIT : LOG_HIT;
+        rec.status = http_parse_status(cached_object->header);
+
+        /*
+         * The header is the object's own, the body may be shared with other
+         * URLs. A compressed object is expanded into a private copy first.
+         */
+        stored = cached_object->header;
+        body = cached_object->body->data;
+        response_size = cached_object->size;
+        if(cached_object->compressed) {
+            stored = (char*)object;
+            body = object + cached_object->header_size;
+            response_size = read_from_cache(cached_object, object);
+        }
+
+        if(response_size >= 0) {
+            /*Answer a Range request with just the parts asked for*/
+            if(info.range[0] == '\0' || rec.status != 200 ||
+                    serve_range(fd, stored, cached_object->header_size, body,
+                                response_size - cached_object->header_size, &info, &rec) < 0) {
+                iov[0].iov_base = stored;
+                iov[0].iov_len = cached_object->header_size;
+                iov[1].iov_base = body;
+                iov[1].iov_len = response_size - cached_object->header_size;
+                rio_writev(fd, iov, 2, 0);
+                rec.bytes = response_size;
+            }
+            cache_release(cached_object);
+            access_log(&rec);
+	    return 0;
+        }
+        cache_release(cached_object);
+    }
+
+    /*
+     * If object has not been cached, hand the request to the miss lane. The
+     * deadline armed for a hit that turned out unreadable is this thread's,
+     * and must not fire on a connection another thread now owns.
+     */
+    timer_cancel(&client_timer);
+    job = (miss_job*)Malloc(sizeof(miss_job));
+    job->fd = fd;
+    job->client = client;
+    strcpy(job->request_header, request_header);
+    strcpy(job->hostname, hostname);
+    strcpy(job->uri, uri);
+    strcpy(job->key_uri, key_uri);
+    job->port = port;
+    job->info = info;
+    job->rec = rec;
+    if(workq_push(info.from_peer ? &peer_queue : &miss_queue, &job->item) == 0)
+        return 1;
+
+    free(job);
+    clienterror(fd, hostname, "503", "Service Unavailable",
+                "Too many requests waiting for");
+    rec.status = 503;
+    access_log(&rec);
+    return 0;
+}
+
+/*
+* do_miss - Fetch a missed object for the client, through the peer that owns
+*           it if there is one, otherwise from the web server
+*/
+void do_miss(miss_job *job)
+{
+    peer *owner = NULL;
+    char ranged[MAXLINE];
+    size_t len;
+
+    /*Ask the peer that owns this URL first, unless a peer is asking us*/
+    if(!job->info.from_peer)
+        owner = peer_owner(job->hostname, job->port, job->key_uri);
+
+    /*A background fetch only fills the cache, the owner's if that is a peer*/
+    if(job->fd < 0) {
+        if(owner == NULL || fetch_from_peer(owner, job->hostname, job->uri, job->port, -1,
+                                            job->request_header, &job->rec) < 0)
+            request_to_server(job->hostname, job->key_uri, job->port, -1,
+                              job->request_header, 1, &job->rec);
+        finish_background_fetch(job);
+        return;
+    }
+
+    /*
+     * Pass a Range request on as it is, without caching the partial answer.
+     * The owning peer, if any, answers it and fills its own cache; otherwise
+     * the whole object comes into ours in the background so the next range
+     * is a hit. A request with no room left for the range gets it all.
+     */
+    if(job->info.range[0] != '\0') {
+        len = strlen(job->request_header) - 2;
+        memcpy(ranged, job->request_header, len);
+        len += snprintf(ranged + len, MAXLINE - len, "Range: %s\r\n", job->info.range);
+        if(job->info.if_range[0] != '\0' && len < MAXLINE)
+            len += snprintf(ranged + len, MAXLINE - len, "If-Range: %s\r\n",
+                            job->info.if_range);
+        if(len + 3 <= MAXLINE) {
+            strcpy(ranged + len, "\r\n");
+            if(owner == NULL || fetch_from_peer(owner, job->hostname, job->uri, job->port,
+                                                job->fd, ranged, &job->rec) < 0) {
+                start_background_fetch(&miss_queue, job->hostname, job->port, job->key_uri,
+                                       job->request_header);
+                request_to_server(job->hostname, job->key_uri, job->port, job->fd,
+                                  ranged, 0, &job->rec);
+            }
+            access_log(&job->rec);
+            return;
+        }
+    }
+
+    if(owner != NULL &&
+            fetch_from_peer(owner, job->hostname, job->uri, job->port, job->fd,
+                            job->request_header, &job->rec) == 0) {
+        access_log(&job->rec);
+        return;
+    }
+
+    request_to_server(job->hostname, job->key_uri, job->port, job->fd,
+                      job->request_header, 1, &job->rec);
+    access_log(&job->rec);
+}
+
+/*
+* serve_range - Answer the client's Range request from a complete cached 200
+*               response: 206 with one part or a multipart/byteranges body,
+*               or 416 if no range fits the body. Returns -1, having sent
+*               nothing, if the whole response should be sent instead.
+*/
+int serve_range(int fd, char *stored, size_t header_size, unsigned char *body,
+                size_t body_size, request_info *info, access_record *rec)
+{
+    static const char *single_skip[] = {"Content-Length", "Content-Range", NULL};
+    static const char *multi_skip[] = {"Content-Length", "Content-Range", "Content-Type", NULL};
+    http_range ranges[HTTP_MAX_RANGES];
+    char header[MAXBUF + MAXLINE], parts[HTTP_MAX_RANGES][MAXLINE];
+    char validator[MAXLINE], content_type[MAXLINE], boundary[32];
+    size_t len, part_len[HTTP_MAX_RANGES], total;
+    struct iovec iov[2 * HTTP_MAX_RANGES + 2];
+    int n, i;
+
+    /*A range of another version of the object cannot be served from ours*/
+    if(info->if_range[0] != '\0' &&
+            (http_header_value(stored, header_size, "ETag", validator, MAXLINE) < 0 ||
+             strcmp(validator, info->if_range)) &&
+            (http_header_value(stored, header_size, "Last-Modified", validator, MAXLINE) < 0 ||
+             strcmp(validator, info->if_range)))
+        return -1;
+
+    if((n = http_parse_range(info->range, body_size, ranges, HTTP_MAX_RANGES)) < 0)
+        return -1;
+
+    if(n == 0) {
+        len = sprintf(header, "HTTP/1.0 416 Range Not Satisfiable\r\n"
+                              "Content-Range: bytes */%lu\r\nContent-Length: 0\r\n\r\n",
+                      (unsigned long)body_size);
+        rio_writen(fd, header, len);
+        rec->status = 416;
+        rec->bytes = len;
+        return 0;
+    }
+
+    if(n == 1) {
+        len = sprintf(header, "HTTP/1.0 206 Partial Content\r\n");
+        len += http_header_lines(header + len, stored, header_size, single_skip);
+        len += sprintf(header + len, "Content-Range: bytes %ld-%ld/%lu\r\n"
+                                     "Content-Length: %ld\r\n\r\n",
+                       ranges[0].first, ranges[0].last, (unsigned long)body_size,
+                       ranges[0].last - ranges[0].first + 1);
+        total = ranges[0].last - ranges[0].first + 1;
+        iov[0].iov_base = header;
+        iov[0].iov_len = len;
+        iov[1].iov_base = body + ranges[0].first;
+        iov[1].iov_len = total;
+        rio_writev(fd, iov, 2, 0);
+        rec->status = 206;
+        rec->bytes = len + total;
+        return 0;
+    }
+
+    /*Several ranges: one multipart body, each part with its own small header*/
+    if(http_header_value(stored, header_size, "Content-Type", content_type, MAXLINE) < 0)
+        strcpy(content_type, "application/octet-stream");
+    sprintf(boundary, "%08lx%08lx", (unsigned long)random(), (unsigned long)random());
+    total = 0;
+    for(i = 0; i < n; i++) {
+        part_len[i] = sprintf(parts[i], "\r\n--%s\r\nContent-Type: %s\r\n"
+                                        "Content-Range: bytes %ld-%ld/%lu\r\n\r\n",
+                              boundary, content_type, ranges[i].first, ranges[i].last,
+                              (unsigned long)body_size);
+        total += part_len[i] + ranges[i].last - ranges[i].first + 1;
+    }
+    total += strlen(boundary) + 8;      /* "\r\n--" boundary "--\r\n" */
+
+    len = sprintf(header, "HTTP/1.0 206 Partial Content\r\n");
+    len += http_header_lines(header + len, stored, header_size, multi_skip);
+    len += sprintf(header + len, "Content-Type: multipart/byteranges; boundary=%s\r\n"
+                                 "Content-Length: %lu\r\n\r\n",
+                   boundary, (unsigned long)total);
+    rec->status = 206;
+    rec->bytes = len + total;
+
+    /*The whole multipart response goes out in a single gather write*/
+    iov[0].iov_base = header;
+    iov[0].iov_len = len;
+    for(i = 0; i < n; i++) {
+        iov[2 * i + 1].iov_base = parts[i];
+        iov[2 * i + 1].iov_len = part_len[i];
+        iov[2 * i + 2].iov_base = body + ranges[i].first;
+        iov[2 * i + 2].iov_len = ranges[i].last - ranges[i].first + 1;
+    }
+    iov[2 * n + 1].iov_base = header + len;
+    iov[2 * n + 1].iov_len = sprintf(header + len, "\r\n--%s--\r\n", boundary);
+    rio_writev(fd, iov, 2 * n + 2, 0);
+    return 0;
+}
+
+/*
+* start_background_fetch - Queue on queue a fetch of an object into the cache,
+*                          with no client attached, unless one is already
+*                          under way. Returns -1 if nothing was queued, 1 if
+*                          that is because the queue is full.
+*/
+int start_background_fetch(workq *queue, char *hostname, int port, char *key_uri,
+                           char *request_header)
+{
+    pending_fetch *pending;
+    miss_job *job;
+
+    pthread_mutex_lock(&pending_lock);
+    for(pending = pending_fetches; pending; pending = pending->next) {
+        if(pending->port == port && !strcmp(pending->hostname, hostname) &&
+                !strcmp(pending->key_uri, key_uri)) {
+            pthread_mutex_unlock(&pending_lock);
+            return -1;
+        }
+    }
+
+    job = (miss_job*)Calloc(1, sizeof(miss_job));
+    job->fd = -1;
+    strcpy(job->request_header, request_header);
+    strcpy(job->hostname, hostname);
+    strcpy(job->uri, key_uri);
+    strcpy(job->key_uri, key_uri);
+    job->port = port;
+    if(workq_push(queue, &job->item) < 0) {
+        pthread_mutex_unlock(&pending_lock);
+        free(job);
+        return 1;
+    }
+
+    pending = (pending_fetch*)Malloc(sizeof(pending_fetch));
+    strcpy(pending->hostname, hostname);
+    pending->port = port;
+    strcpy(pending->key_uri, key_uri);
+    pending->next = pending_fetches;
+    pending_fetches = pending;
+    pthread_mutex_unlock(&pending_lock);
+    return 0;
+}
+
+/*
+* prefetch_page - Warm the cache with the same-origin resources an HTML page
+*                 just sent to a client embeds, at most PREFETCH_PER_PAGE of
+*                 them and only while the prefetch queue has room
+*/
+void prefetch_page(char *hostname, int port, char *page_uri, unsigned char *html, size_t size)
+{
+    char uris[PREFETCH_PER_PAGE][MAXLINE];
+    char key_uri[MAXLINE], request_header[MAXLINE];
+    cache_elem *cached_object;
+    int i, n;
+
+    n = prefetch_extract(hostname, port, page_uri, html, size, uris, PREFETCH_PER_PAGE);
+    for(i = 0; i < n; i++) {
+        urlnorm_canonicalize(hostname, uris[i], key_uri);
+        if((cached_object = check_cache_list(cache, hostname, &port, key_uri)) != NULL) {
+            cache_release(cached_object);
+            continue;
+        }
+        make_background_request(request_header, hostname, port, uris[i]);
+        if(start_background_fetch(&prefetch_queue, hostname, port, key_uri,
+                                  request_header) == 1)
+            break;
     }
+}
 
-    /*If object has not been cached, pass the request to web server*/
-    request_to_server(hostname, uri, port, fd, request_header);
+void finish_background_fetch(miss_job *job)
+{
+    pending_fetch **link, *pending;
+
+    pthread_mutex_lock(&pending_lock);
+    for(link = &pending_fetches; (pending = *link) != NULL; link = &pending->next) {
+        if(pending->port == job->port && !strcmp(pending->hostname, job->hostname) &&
+                !strcmp(pending->key_uri, job->key_uri)) {
+            *link = pending->next;
+            free(pending);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pending_lock);
+}
+
+/*
+* start_tunnel - Hand a CONNECT request to a thread of its own, giving the
+*                worker and the client's scheduler slot back. Returns -1 if
+*                MAX_TUNNELS are open already.
+*/
+int start_tunnel(int fd, struct in_addr client, rio_t *rio, char *authority,
+                 access_record *rec)
+{
+    tunnel_job *job;
+    pthread_t tid;
+
+    if(__atomic_add_fetch(&tunnels, 1, __ATOMIC_RELAXED) > MAX_TUNNELS) {
+        __atomic_sub_fetch(&tunnels, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    /*The copy of rio must point into its own buffer*/
+    job = (tunnel_job*)Malloc(sizeof(tunnel_job));
+    job->fd = fd;
+    job->rio = *rio;
+    job->rio.rio_bufptr = job->rio.rio_buf + (rio->rio_bufptr - rio->rio_buf);
+    strcpy(job->authority, authority);
+    job->rec = *rec;
+
+    timer_cancel(&client_timer);
+    sched_done(client);
+    Pthread_create(&tid, NULL, tunnel_thread, job);
+    return 0;
+}
+
+/*
+* do_tunnel - Handle a CONNECT request: connect to <host:port>, acknowledge
+*             the client and relay bytes both ways until either side is done
+*/
+void do_tunnel(int fd, rio_t *rio, char *authority, access_record *rec)
+{
+    char buf[MAXLINE], hostname[MAXLINE];
+    char *port_ptr, *line;
+    ssize_t len;
+    int port = 443, server_fd;
+
+    /*The request header carries nothing we need, skip to the blank line*/
+    while((len = rio_readlinev(rio, &line, MAXLINE)) > 0 &&
+          !(len == 2 && line[0] == '\r'))
+        ;
+
+    strcpy(hostname, authority);
+    if((port_ptr = strrchr(hostname, ':')) != NULL) {
+        port_ptr[0] = '\0';
+        port = atoi(port_ptr + 1);
+    }
+
+    if((server_fd = open_origin(hostname, port)) < 0) {
+        clienterror(fd, authority, "502", "Bad Gateway",
+                        "Proxy could not connect to");
+        rec->status = 502;
+        return;
+    }
+
+    sprintf(buf, "HTTP/1.0 200 Connection established\r\n\r\n");
+    rec->outcome = LOG_TUNNEL;
+    rec->status = 200;
+    /*The tunnel has its own idle limit; the per-phase deadlines don't apply*/
+    timer_cancel(&client_timer);
+    timer_cancel(&server_timer);
+    if(rio_writen(fd, buf, strlen(buf)) > 0)
+        rec->bytes = tunnel_relay(fd, rio, server_fd, timeout_ms[TIMEOUT_IDLE]);
+
+    close_origin(server_fd);
+}
+
+/*
+* set_negative_ttl - Parse "<status>=<seconds>" or "connect=<seconds>" into
+*                    negative_ttl. Returns -1 if the spec is malformed.
+*/
+int set_negative_ttl(char *spec)
+{
+    int status, ttl;
+
+    if(sscanf(spec, "connect=%d", &ttl) == 1)
+        status = NEGATIVE_CONNECT;
+    else if(sscanf(spec, "%d=%d", &status, &ttl) != 2 || status < 400 || status >= MAX_STATUS)
+        return -1;
+    if(ttl < 0)
+        return -1;
+
+    negative_ttl[status] = ttl;
+    return 0;
+}
+
+/*
+* set_timeout - Parse "<connect|idle|header|body>=<seconds>" into timeout_ms.
+*               Returns -1 if the spec is malformed.
+*/
+int set_timeout(char *spec)
+{
+    char *eq = strchr(spec, '=');
+    double seconds;
+    int i;
+
+    if(eq == NULL || sscanf(eq + 1, "%lf", &seconds) != 1 || seconds < 0)
+        return -1;
+    for(i = 0; i < TIMEOUT_COUNT; i++) {
+        if(strlen(timeout_names[i]) == (size_t)(eq - spec) &&
+                !strncmp(spec, timeout_names[i], eq - spec)) {
+            timeout_ms[i] = (int)(seconds * 1000);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+* cache_expiry - When a response with this status should expire from the cache:
+*                0 for never, -1 if it must not be cached at all. Successes and
+*                redirects are kept; errors only if they have a negative TTL.
+*/
+time_t cache_expiry(int status)
+{
+    if(status < 400)
+        return 0;
+    if(status < MAX_STATUS && negative_ttl[status] > 0)
+        return time(NULL) + negative_ttl[status];
+    return -1;
 }
 
 /*
@@ -153,23 +1071,38 @@ void do_transaction(int fd)
 */
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
 {
-    char buf[MAXLINE], body[MAXBUF];
+    char header[MAXLINE], body[MAXBUF];
+    struct iovec iov[2];
 
-    /*Build the HTTP response body*/
-    sprintf(body, "<html><title>Proxy error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Proxy</em>\r\n", body);
+    build_error(header, body, cause, errnum, shortmsg, longmsg);
+    iov[0].iov_base = header;
+    iov[0].iov_len = strlen(header);
+    iov[1].iov_base = body;
+    iov[1].iov_len = strlen(body);
+    rio_writev(fd, iov, 2, 0);
+}
+
+/*
+* build_error - Format the header and body of a proxy error response
+*/
+void build_error(char *header, char *body, char *cause, char *errnum, char *shortmsg,
+                 char *longmsg)
+{
+    /*Build the HTTP response body; a long cause is cut short*/
+    snprintf(body, MAXBUF,
+             "<html><title>Proxy error</title>"
+             "<body bgcolor=""ffffff"">\r\n"
+             "%s: %s\r\n"
+             "<p>%s: %s\r\n"
+             "<hr><em>The Proxy</em>\r\n",
+             errnum, shortmsg, longmsg, cause);
 
-    /*Print the HTTP response*/
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    rio_writen(fd, buf, strlen(buf));
-    rio_writen(fd, body, strlen(body));
+    /*Build the HTTP response header*/
+    snprintf(header, MAXLINE,
+             "HTTP/1.0 %s %s\r\n"
+             "Content-type: text/html\r\n"
+             "Content-length: %d\r\n\r\n",
+             errnum, shortmsg, (int)strlen(body));
 }
 
 /*
@@ -206,97 +1139,412 @@ void parse_request_url(char *url, char *hostname, int *port, char *uri)
 
 /*
 * make_request_info - This function creates the request via the information from
-*                     parse_request_url function.
+*                     parse_request_url function, and notes the client headers
+*                     the proxy itself acts on in info.
 */
 
-void make_request_info(rio_t *rio, char *request_header, char *method, char *hostname, char *uri)
+void make_request_info(rio_t *rio, char *request_header, char *method, char *hostname, char *uri,
+                       request_info *info)
 {
-    char buf[MAXLINE];
+    char buf[MAXLINE], *line;
+    ssize_t len;
+    size_t header_len;
+    int has_host = 0;
+
+    info->from_peer = 0;
+    info->peer[0] = '\0';
+    info->range[0] = '\0';
+    info->if_range[0] = '\0';
 
     /* Make the first line of request header */
-    strcpy(request_header, "");
     sprintf(request_header, "%s %s HTTP/1.0\r\n", method, uri);
 
-    /* Read client's rest request */
-    rio_readlineb(rio, buf, MAXLINE);
-    
-    while(strcmp(buf, "\r\n")) {
-        rio_readlineb(rio, buf, MAXLINE);
-        if (strstr(buf, "Host:")) {
-	    sprintf(request_header, "%s%s", request_header, buf);
-	} else {
-            sprintf(request_header, "%sHost: %s\r\n",request_header, hostname);
+    /*
+     * Read client's rest request, forwarding only its Host header. Lines
+     * are views of the rio buffer; every prefix test fails at the line's
+     * own newline, so none reads past it
+     */
+    header_len = strlen(request_header);
+    while((len = rio_readlinev(rio, &line, MAXLINE)) > 0 &&
+          !(len == 2 && line[0] == '\r')) {
+        if(!strncasecmp(line, "Host:", 5)) {
+            /* Leave room for the headers the proxy adds */
+            if(header_len + len < MAXLINE / 2) {
+                memcpy(request_header + header_len, line, len);
+                header_len += len;
+                request_header[header_len] = '\0';
+                has_host = 1;
+            }
+        } else if(!strncasecmp(line, PEER_HEADER ":", strlen(PEER_HEADER) + 1)) {
+            http_header_value(line, len, PEER_HEADER, info->peer, MAXLINE);
+        } else if(!strncasecmp(line, "Range:", 6)) {
+            http_header_value(line, len, "Range", info->range, MAXLINE);
+        } else if(!strncasecmp(line, "If-Range:", 9)) {
+            http_header_value(line, len, "If-Range", info->if_range, MAXLINE);
         }
     }
+    if(!has_host) {
+        sprintf(buf, "Host: %s\r\n", hostname);
+        strcat(request_header, buf);
+    }
 
-    sprintf(request_header, "%s%s", request_header, user_agent_hdr);
-    sprintf(request_header, "%s%s", request_header, accept_hdr);
-    sprintf(request_header, "%s%s", request_header, accept_encoding_hdr);
-    sprintf(request_header, "%sConnection: close\r\n", request_header);
-    sprintf(request_header, "%sProxy-Connection: close\r\n", request_header);
-    sprintf(request_header, "%s\r\n", request_header);
+    add_proxy_headers(request_header);
 }
 
+/*
+* make_background_request - Build the request for a fetch the proxy makes on
+*                           its own, with no client request behind it
+*/
+void make_background_request(char *request_header, char *hostname, int port, char *uri)
+{
+    if(port == 80)
+        sprintf(request_header, "GET %s HTTP/1.0\r\nHost: %s\r\n", uri, hostname);
+    else
+        sprintf(request_header, "GET %s HTTP/1.0\r\nHost: %s:%d\r\n", uri, hostname, port);
+    add_proxy_headers(request_header);
+}
 
 /*
-* request_to_serer - pass client's request to web server
+* add_proxy_headers - Append the headers every request the proxy sends carries,
+*                     and the blank line ending the header
 */
-void request_to_server(char *hostname, char *uri, int port, int client_fd, char* request_header) {
+void add_proxy_headers(char *request_header)
+{
+    strcat(request_header, user_agent_hdr);
+    strcat(request_header, accept_hdr);
+    strcat(request_header, accept_encoding_hdr);
+    strcat(request_header, "Connection: close\r\n");
+    strcat(request_header, "Proxy-Connection: close\r\n");
+    strcat(request_header, "\r\n");
+}
 
-    unsigned char buf[MAXLINE];
-    unsigned char object_data[MAX_OBJECT_SIZE];
-    int proxy_fd, is_over;
-    rio_t rio;
-    size_t read_num, object_size = 0;
 
-    /*Establish connection between proxy and web server*/
-    proxy_fd = open_clientfd_r(hostname, port);
+/*
+* request_to_server - pass client's request to web server and relay its response,
+*                     caching it under the canonical key_uri if cacheable. With
+*                     client_fd -1 the response only goes into the cache.
+*/
+void request_to_server(char *hostname, char *key_uri, int port, int client_fd, char* request_header,
+                       int cacheable, access_record *rec) {
+
+    int proxy_fd;
+    char header[MAXLINE], body[MAXBUF];
+    struct iovec iov[2];
 
-    /*Check whether proxy_fd is valid or not*/
+    /*
+     * Establish connection between proxy and web server, unless it just
+     * failed: the origin is remembered as down for a while, so the next
+     * requests for any of its URLs don't each wait for a failed connect.
+     */
+    if(origin_is_down(hostname, port)) {
+        proxy_fd = -1;
+        rec->outcome = LOG_NEGATIVE_HIT;
+    } else if((proxy_fd = open_origin(hostname, port)) < 0) {
+        origin_mark_down(hostname, port);
+    }
+
+    /*The origin is unreachable, tell the client if there is one*/
     if(proxy_fd < 0) {
-        printf("Establish connection to web server error");
+        rec->status = 502;
+        if(client_fd < 0)
+            return;
+        build_error(header, body, hostname, "502", "Bad Gateway",
+                    "Proxy could not connect to");
+        timer_arm(&client_timer, client_fd, timeout_ms[TIMEOUT_BODY]);
+        iov[0].iov_base = header;
+        iov[0].iov_len = strlen(header);
+        iov[1].iov_base = body;
+        iov[1].iov_len = strlen(body);
+        rio_writev(client_fd, iov, 2, 0);
+        rec->bytes = iov[0].iov_len + iov[1].iov_len;
         return;
     }
-
-    Rio_readinitb(&rio, proxy_fd);
+    rec->outcome = LOG_MISS;
 
     /*Send client's request to web server*/
     rio_writen(proxy_fd, request_header, strlen(request_header));
 
-    /*Read response info from web server*/
-    while((read_num = rio_readlineb(&rio, buf, MAXLINE)) != 0) {
+    relay_response(proxy_fd, client_fd, hostname, port, key_uri, cacheable, rec);
+}
 
-        /*Send web server's response to client*/
-        rio_writen(client_fd, buf, read_num);
+/*
+* open_origin - Connect to an upstream server under the connect deadline. The
+*               connection then stays under the body deadline, restarted by
+*               every read, until close_origin.
+*/
+int open_origin(char *hostname, int port)
+{
+    int fd;
 
-        /*Check whether web object can be cached based on MAX_OBJECT_SIZE*/
-        is_over = check_object_size(&object_size, read_num, object_data, buf);
-				
+    if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+    timer_arm(&server_timer, fd, timeout_ms[TIMEOUT_CONNECT]);
+    if(connect_clientfd_r(fd, hostname, port) < 0 || timer_fired(&server_timer)) {
+        close_origin(fd);
+        return -1;
     }
+    timer_arm(&server_timer, fd, timeout_ms[TIMEOUT_BODY]);
+    return fd;
+}
 
-    if(!is_over) {
-        insert_to_cache(cache, hostname, &port, uri, object_data, object_size);
+/*
+* origin_is_down - Did connecting to this origin fail within the connect TTL?
+*/
+int origin_is_down(char *hostname, int port)
+{
+    origin_down *slot = &down_origins[origin_slot(hostname, port)];
+    int down;
+
+    pthread_mutex_lock(&down_lock);
+    down = slot->port == port && slot->until > time(NULL) && !strcmp(slot->hostname, hostname);
+    pthread_mutex_unlock(&down_lock);
+    return down;
+}
+
+/*
+* origin_mark_down - Remember a failed connect for negative_ttl[NEGATIVE_CONNECT]
+*                    seconds, if that is set
+*/
+void origin_mark_down(char *hostname, int port)
+{
+    origin_down *slot = &down_origins[origin_slot(hostname, port)];
+
+    if(negative_ttl[NEGATIVE_CONNECT] <= 0)
+        return;
+    pthread_mutex_lock(&down_lock);
+    strcpy(slot->hostname, hostname);
+    slot->port = port;
+    slot->until = time(NULL) + negative_ttl[NEGATIVE_CONNECT];
+    pthread_mutex_unlock(&down_lock);
+}
+
+/*The down_origins slot of an origin*/
+unsigned int origin_slot(char *hostname, int port)
+{
+    unsigned int hash = port;
+
+    while(*hostname)
+        hash = hash * 31 + (unsigned char)*hostname++;
+    return hash % ORIGIN_DOWN_SLOTS;
+}
+
+/*
+* close_origin - Close an upstream connection, cancelling its deadline first
+*                so the timer can never shut down a reused descriptor
+*/
+void close_origin(int fd)
+{
+    timer_cancel(&server_timer);
+    Close(fd);
+}
+
+/*
+* fetch_from_peer - Fetch a URL through the peer that owns it. The peer sees an
+*                   ordinary proxy request marked with PEER_HEADER, so it answers
+*                   from its cache or the origin and never forwards it again.
+*                   Returns -1, with nothing sent to the client, if the peer
+*                   could not be used and the caller should go to the origin.
+*/
+int fetch_from_peer(peer *owner, char *hostname, char *uri, int port, int client_fd,
+                    char *request_header, access_record *rec)
+{
+    char peer_request[MAXBUF + MAXLINE];
+    char *header_lines;
+    int peer_fd;
+    size_t len;
+
+    if((peer_fd = open_origin(owner->host, owner->port)) < 0) {
+        peer_mark_down(owner);
+        return -1;
     }
 
-    Close(proxy_fd);
+    /*Absolute URL request line, the client's headers, then our marker*/
+    header_lines = strstr(request_header, "\r\n") + 2;
+    len = sprintf(peer_request, "GET http://%s:%d%s HTTP/1.0\r\n", hostname, port, uri);
+    len += sprintf(peer_request + len, "%.*s", (int)(strlen(header_lines) - 2), header_lines);
+    len += sprintf(peer_request + len, "%s: %s\r\n\r\n", PEER_HEADER, peer_self()->name);
 
+    if(rio_writen(peer_fd, peer_request, len) < 0) {
+        close_origin(peer_fd);
+        return -1;
+    }
+
+    rec->outcome = LOG_PEER;
+    return relay_response(peer_fd, client_fd, hostname, port, uri, 0, rec);
 }
 
-int check_object_size(size_t *object_size, size_t read_num, unsigned char *object_data, unsigned char *buf)
+/*
+* relay_response - Read the response on server_fd and deliver it to the client.
+*                  The response is collected in a bounded per-request buffer,
+*                  so the server connection is released as soon as the server
+*                  is done sending, no matter how slowly the client reads.
+*                  Every piece is also passed on as it arrives, as far as the
+*                  client takes it without waiting; the rest follows once the
+*                  server is done. A response that outgrows the buffer is
+*                  relayed as it arrives. Chunked bodies are de-chunked on the
+*                  way in, so both the client and the cache see a plain body.
+*                  Closes server_fd; returns -1 if no response header could
+*                  be read.
+*/
+int relay_response(int server_fd, int client_fd, char *hostname, int port, char *uri,
+                   int cacheable, access_record *rec)
 {
-    int is_over, i;
-    if(*object_size + read_num > MAX_OBJECT_SIZE) {
+    unsigned char buf[MAXBUF];
+    unsigned char object_data[RELAY_BUF_SIZE];
+    char resp_header[MAXBUF], client_header[MAXBUF];
+    struct iovec iov[1];
+    int is_over = 0, is_complete = 0, more, client_gone = (client_fd < 0);
+    rio_t rio;
+    ssize_t read_num = 0, header_size, n;
+    size_t object_size = 0, received = 0, client_header_size = 0, sent = 0;
+    http_response resp;
+    chunk_decoder decoder;
+    time_t expires;
 
-        /*This object can not be cached because its size is over criteria*/
-        is_over = 1;
+    Rio_readinitb(&rio, server_fd);
 
-    } else {
+    /*Read the response header, keeping room for a Content-Length line*/
+    header_size = http_read_response_header(&rio, resp_header,
+                                            MAXBUF - HTTP_FINISH_ROOM, &resp);
+    if(header_size <= 0) {
+        close_origin(server_fd);
+        return -1;
+    }
+    rec->status = resp.status;
+    chunk_decoder_init(&decoder);
+    is_complete = (resp.content_length == 0);
+
+    /*
+     * The client's header can go out before the body is in, so a chunked
+     * body reaches it delimited by closing; the cached header gets the
+     * Content-Length once the size is known.
+     */
+    memcpy(client_header, resp_header, header_size);
+    client_header_size = http_finish_header(client_header, header_size, &resp, -1);
+
+    /*Read the response body from web server*/
+    while(!is_complete && (read_num = rio_readsomeb(&rio, buf, MAXBUF)) > 0) {
+        /*The body deadline counts from the last byte received*/
+        timer_arm(&server_timer, server_fd, timeout_ms[TIMEOUT_BODY]);
+
+        /*Strip chunk framing, or stop at the advertised length*/
+        if(resp.chunked) {
+            if((read_num = chunk_decode(&decoder, buf, read_num)) < 0)
+                break;
+            is_complete = (decoder.state == CHUNK_DONE);
+        } else if(resp.content_length >= 0) {
+            if(received + read_num >= resp.content_length) {
+                read_num = resp.content_length - received;
+                is_complete = 1;
+            }
+            received += read_num;
+        }
 
-        for(i = 0; i < read_num; i++) {
-            object_data[(*object_size)++] = buf[i];
+        /*Keep buffering while the response still fits, passing on what we can*/
+        if(!is_over && object_size + read_num <= RELAY_BUF_SIZE) {
+            memcpy(object_data + object_size, buf, read_num);
+            object_size += read_num;
+            if(!client_gone) {
+                if((n = relay_pending(client_fd, client_header, client_header_size,
+                                      object_data, object_size, sent, 0, 0)) < 0)
+                    client_gone = 1;
+                else
+                    sent += n;
+            }
+            continue;
         }
-        is_over = 0;
+
+        /*
+         * The object is too large to be cached. Flush what the client has not
+         * had yet and relay the remainder as it arrives. A partial packet is
+         * held back only when the next piece of the body is already buffered;
+         * a slowly arriving body must not sit corked.
+         */
+        if(client_gone)
+            break;
+        more = !is_complete && rio.rio_cnt > 0;
+        timer_arm(&client_timer, client_fd, timeout_ms[TIMEOUT_BODY]);
+        if(!is_over) {
+            is_over = 1;
+            if(relay_pending(client_fd, client_header, client_header_size,
+                             object_data, object_size, sent, 1, 1) < 0)
+                break;
+            sent = client_header_size + object_size;
+        }
+        iov[0].iov_base = buf;
+        iov[0].iov_len = read_num;
+        if(rio_writev(client_fd, iov, 1, more) < 0)
+            break;
+        sent += read_num;
+        timer_arm(&client_timer, client_fd, timeout_ms[TIMEOUT_BODY]);
+    }
+    rec->bytes = sent;
+
+    /*A body delimited by the connection is complete at EOF, unless we cut it*/
+    if(!resp.chunked && resp.content_length < 0 && read_num == 0 &&
+            !timer_fired(&server_timer))
+        is_complete = 1;
+
+    /*The server is done with us, release it before talking to the client*/
+    close_origin(server_fd);
+
+    if(!is_over) {
+        header_size = http_finish_header(resp_header, header_size, &resp, object_size);
+
+        /*
+         * Publish a complete object to the cache first so concurrent requests
+         * hit, then deliver the rest of our private copy to the client.
+         */
+        expires = cache_expiry(resp.status);
+        if(cacheable && is_complete && expires >= 0 &&
+                header_size + object_size <= MAX_OBJECT_SIZE) {
+            insert_to_cache(cache, hostname, &port, uri, resp_header, header_size,
+                            object_data, object_size, expires,
+                            compress_cache && resp.compressible);
+        }
+        if(!client_gone) {
+            timer_arm(&client_timer, client_fd, timeout_ms[TIMEOUT_BODY]);
+            if(relay_pending(client_fd, client_header, client_header_size,
+                             object_data, object_size, sent, 0, 1) >= 0)
+                rec->bytes = client_header_size + object_size;
+        }
+
+        /*The browser will want this page's resources next; fetch them now*/
+        if(prefetch_enabled && cacheable && client_fd >= 0 && is_complete &&
+                resp.status == 200 && resp.html)
+            prefetch_page(hostname, port, uri, object_data, object_size);
     }
-    return is_over;
+    return 0;
 }
 
+/*
+* relay_pending - Write to the client what it has not had yet of header then
+*                 body, sent bytes having gone out already. With block 0 only
+*                 what the socket takes without waiting is written, otherwise
+*                 all of it, with more as for rio_writev. Returns the bytes
+*                 written, or -1 if the client is gone.
+*/
+ssize_t relay_pending(int fd, char *header, size_t header_size, unsigned char *body,
+                      size_t body_size, size_t sent, int more, int block)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t body_sent = sent > header_size ? sent - header_size : 0;
+    ssize_t n;
+
+    iov[0].iov_base = header + sent - body_sent;
+    iov[0].iov_len = header_size - (sent - body_sent);
+    iov[1].iov_base = body + body_sent;
+    iov[1].iov_len = body_size - body_sent;
+    if(block)
+        return rio_writev(fd, iov, 2, more);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    while((n = sendmsg(fd, &msg, MSG_DONTWAIT | (more ? MSG_MORE : 0))) < 0 && errno == EINTR)
+        ;
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    return n;
+}
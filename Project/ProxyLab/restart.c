@@ -0,0 +1,197 @@
+/*
+ * Name: Chih-Feng Lin
+         Chi-Heng Wu
+ * Andrew ID: chihfenl
+              chihengw
+
+ *
+ * restart.c - hot restart. A running proxy waits on a UNIX socket for its
+ *             successor. When the successor connects, the old process
+ *             passes it the listening socket (SCM_RIGHTS) and a copy of
+ *             the cache. Once the successor acknowledges both, the old
+ *             process tells its own acceptor to stop; if the successor
+ *             dies or the copy fails, it keeps serving instead. Both
+ *             processes accept from the same socket during the handoff,
+ *             so no connection is refused, and the old one exits once its
+ *             in-flight requests are finished.
+ */
+
+#include <sys/un.h>
+#include "restart.h"
+#include "cache.h"
+
+typedef struct handoff {
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    int sockfd;
+    int listenfd;
+    cache_list *cache;
+    int notify_fd;
+} handoff;
+
+static void *handoff_thread(void *vargp);
+static int unix_socket(char *path, struct sockaddr_un *addr);
+static int send_fd(int sockfd, int fd);
+static int recv_fd(int sockfd);
+
+/*
+ * restart_takeover - If a proxy is waiting for a successor on path, take
+ *                    over its listening socket and cache. Only a complete
+ *                    cache is acknowledged, which lets the old proxy stop.
+ *                    Returns the listening socket, or -1 if there is
+ *                    nobody to take over from or the cache did not come
+ *                    through; the old proxy then keeps serving.
+ */
+int restart_takeover(char *path, cache_list *cache)
+{
+    struct sockaddr_un addr;
+    int sockfd, listenfd;
+
+    if((sockfd = unix_socket(path, &addr)) < 0)
+        return -1;
+    if(connect(sockfd, (SA*)&addr, sizeof(addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    if((listenfd = recv_fd(sockfd)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    if(cache_load(cache, sockfd) < 0) {
+        fprintf(stderr, "restart: cache transfer incomplete, the old proxy keeps serving\n");
+        close(listenfd);
+        close(sockfd);
+        return -1;
+    }
+    rio_writen(sockfd, "A", 1);
+    close(sockfd);
+    return listenfd;
+}
+
+/*
+ * restart_listen - Wait on path, in the background, for a successor. After
+ *                  handing over, one byte is written to notify_fd; the
+ *                  caller stops accepting and drains.
+ */
+void restart_listen(char *path, int listenfd, cache_list *cache, int notify_fd)
+{
+    struct sockaddr_un addr;
+    handoff *h;
+    pthread_t tid;
+    int sockfd;
+
+    if((sockfd = unix_socket(path, &addr)) < 0)
+        unix_error("restart: socket error");
+    unlink(path);
+    if(bind(sockfd, (SA*)&addr, sizeof(addr)) < 0 || listen(sockfd, 1) < 0)
+        unix_error("restart: cannot listen for a successor");
+
+    h = (handoff*)Malloc(sizeof(handoff));
+    strcpy(h->path, addr.sun_path);
+    h->sockfd = sockfd;
+    h->listenfd = listenfd;
+    h->cache = cache;
+    h->notify_fd = notify_fd;
+    Pthread_create(&tid, NULL, handoff_thread, h);
+    Pthread_detach(tid);
+}
+
+/*
+ * Hand the listener and the cache to each successor that connects, until
+ * one acknowledges them; only then stop accepting
+ */
+static void *handoff_thread(void *vargp)
+{
+    handoff *h = (handoff*)vargp;
+    int connfd;
+    char ack;
+
+    while(1) {
+        if((connfd = accept(h->sockfd, NULL, NULL)) < 0) {
+            if(errno == EINTR)
+                continue;
+            return NULL;
+        }
+        if(send_fd(connfd, h->listenfd) == 0 && cache_save(h->cache, connfd) == 0 &&
+                rio_readn(connfd, &ack, 1) == 1)
+            break;
+        fprintf(stderr, "restart: handoff failed, still serving\n");
+        close(connfd);
+    }
+    close(connfd);
+
+    /*The successor owns the path from now on and binds it anew*/
+    close(h->sockfd);
+    rio_writen(h->notify_fd, "x", 1);
+    free(h);
+    return NULL;
+}
+
+static int unix_socket(char *path, struct sockaddr_un *addr)
+{
+    if(strlen(path) >= sizeof(addr->sun_path))
+        return -1;
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+/*Send fd as ancillary data on a one-byte message*/
+static int send_fd(int sockfd, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char byte = 'L';
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sockfd, &msg, 0) == 1 ? 0 : -1;
+}
+
+static int recv_fd(int sockfd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char byte;
+    int fd;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if(recvmsg(sockfd, &msg, 0) != 1)
+        return -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
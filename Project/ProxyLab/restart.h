@@ -0,0 +1,7 @@
+#include "csapp.h"
+
+struct cache_list;
+
+/*Function prototypes*/
+int restart_takeover(char *path, struct cache_list *cache);
+void restart_listen(char *path, int listenfd, struct cache_list *cache, int notify_fd);
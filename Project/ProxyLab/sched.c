@@ -0,0 +1,337 @@
+/*
+ * Name: Chih-Feng Lin
+         Chi-Heng Wu
+ * Andrew ID: chihfenl
+              chihengw
+
+ *
+ * sched.c - per-client fair scheduling in front of the worker pool. The
+ *           acceptor queues each connection under its client IP; workers
+ *           take connections round-robin across clients, so a client with
+ *           hundreds of connections queued gets one turn like everybody
+ *           else. Each client also has a token bucket limiting its request
+ *           rate, a cap on how many workers it may hold at once and a cap
+ *           on its queue, beyond which new connections are refused.
+ *           A connection that turns out to come from a cache peer gives
+ *           back what it took, so peers are not held back by the limits
+ *           of whatever clients share their address.
+ */
+
+#include "sched.h"
+
+typedef struct client_state {
+    struct in_addr addr;
+    double tokens;
+    struct timespec refilled;       /* when tokens was last brought up to date */
+    int queued, active;
+    sched_conn *head, *tail;        /* connections waiting for a worker */
+    struct client_state *hash_next;
+    struct client_state *rr_next;   /* ring of clients with queued connections */
+    struct client_state *rr_prev;
+    unsigned long accepted, rejected, throttled;
+} client_state;
+
+/*Global variables*/
+static sched_limits limits;
+static client_state *table[SCHED_HASH_SIZE];
+static client_state *rr_cursor;     /* next client to get a turn */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+static unsigned long clients, submitted, dispatched, rejected, throttled;
+
+static client_state *find_client(struct in_addr addr, int create);
+static void refill(client_state *c, struct timespec *now);
+static int eligible(client_state *c, struct timespec *now);
+static void rr_insert(client_state *c);
+static void rr_remove(client_state *c);
+static void sweep_idle(struct timespec *now);
+static double seconds_between(struct timespec *from, struct timespec *to);
+
+void sched_init(sched_limits *l)
+{
+    pthread_condattr_t attr;
+
+    limits = *l;
+    if(limits.rate > 0 && limits.burst < 1)
+        limits.burst = 1;
+
+    /*Deadlines for token refills are computed on the monotonic clock*/
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ready, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/*
+ * sched_submit - Queue an accepted connection for its client. Returns -1
+ *                if the client already has max_queued connections waiting;
+ *                the caller then refuses the connection.
+ */
+int sched_submit(int fd, struct in_addr client)
+{
+    client_state *c;
+    sched_conn *conn;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&lock);
+
+    if(++submitted % SCHED_SWEEP_INTERVAL == 0)
+        sweep_idle(&now);
+
+    c = find_client(client, 1);
+    if(limits.max_queued > 0 && c->queued >= limits.max_queued) {
+        c->rejected++;
+        rejected++;
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+
+    conn = (sched_conn*)Malloc(sizeof(sched_conn));
+    conn->fd = fd;
+    conn->client = client;
+    conn->delayed = 0;
+    conn->next = NULL;
+    if(c->tail)
+        c->tail->next = conn;
+    else
+        c->head = conn;
+    c->tail = conn;
+    c->accepted++;
+
+    if(c->queued++ == 0)
+        rr_insert(c);
+
+    pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/*
+ * sched_next - Block until some client may be served, then hand its oldest
+ *              connection to the calling worker. Clients take turns.
+ */
+void sched_next(sched_conn *out)
+{
+    client_state *c, *start;
+    sched_conn *conn;
+    struct timespec now, deadline;
+    double wait, shortest;
+
+    pthread_mutex_lock(&lock);
+    while(1) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        shortest = -1;
+
+        /*One lap around the clients with queued connections*/
+        if((start = rr_cursor) != NULL) {
+            c = start;
+            do {
+                if(eligible(c, &now))
+                    goto found;
+
+                /*Out of tokens: note when the next one arrives*/
+                if(limits.rate > 0 && c->tokens < 1 &&
+                        (limits.max_active <= 0 || c->active < limits.max_active)) {
+                    wait = (1 - c->tokens) / limits.rate;
+                    if(shortest < 0 || wait < shortest)
+                        shortest = wait;
+                }
+                c = c->rr_next;
+            } while(c != start);
+        }
+
+        /*Nobody can go now; sleep until a token or a connection turns up*/
+        if(shortest < 0) {
+            pthread_cond_wait(&ready, &lock);
+        } else {
+            deadline = now;
+            deadline.tv_sec += (time_t)shortest;
+            deadline.tv_nsec += (long)((shortest - (time_t)shortest) * 1e9) + 1000000;
+            if(deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&ready, &lock, &deadline);
+        }
+    }
+
+found:
+    conn = c->head;
+    c->head = conn->next;
+    if(c->head == NULL)
+        c->tail = NULL;
+    if(limits.rate > 0)
+        c->tokens -= 1;
+    c->active++;
+    dispatched++;
+
+    /*The next turn goes to the following client*/
+    rr_cursor = c->rr_next;
+    if(--c->queued == 0)
+        rr_remove(c);
+
+    pthread_mutex_unlock(&lock);
+    *out = *conn;
+    free(conn);
+}
+
+/*Give back the worker slot a client held*/
+void sched_done(struct in_addr client)
+{
+    client_state *c;
+
+    pthread_mutex_lock(&lock);
+    if((c = find_client(client, 0)) != NULL)
+        c->active--;
+    pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * sched_exempt - A connection handed out for client came from a cache peer:
+ *                give back its token and its worker slot. Peers forward
+ *                misses to each other, and would wait on each other's
+ *                workers if they were capped like clients. The connection
+ *                must not be passed to sched_done afterwards.
+ */
+void sched_exempt(struct in_addr client)
+{
+    client_state *c;
+
+    pthread_mutex_lock(&lock);
+    if((c = find_client(client, 0)) != NULL) {
+        c->active--;
+        if(limits.rate > 0 && ++c->tokens > limits.burst)
+            c->tokens = limits.burst;
+    }
+    pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&lock);
+}
+
+/*Print global counters followed by one line per known client*/
+void sched_dump_stats(FILE *fp)
+{
+    client_state *c;
+    int i;
+
+    pthread_mutex_lock(&lock);
+    fprintf(fp, "sched: clients=%lu submitted=%lu dispatched=%lu rejected=%lu throttled=%lu\n",
+            clients, submitted, dispatched, rejected, throttled);
+    for(i = 0; i < SCHED_HASH_SIZE; i++) {
+        for(c = table[i]; c; c = c->hash_next) {
+            fprintf(fp, "  %-15s queued=%d active=%d accepted=%lu rejected=%lu throttled=%lu\n",
+                    inet_ntoa(c->addr), c->queued, c->active,
+                    c->accepted, c->rejected, c->throttled);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    fflush(fp);
+}
+
+/*
+ * May this client start another connection now? A connection held back by
+ * the rate limit is counted as throttled once.
+ */
+static int eligible(client_state *c, struct timespec *now)
+{
+    if(limits.max_active > 0 && c->active >= limits.max_active)
+        return 0;
+    if(limits.rate <= 0)
+        return 1;
+
+    refill(c, now);
+    if(c->tokens >= 1)
+        return 1;
+
+    if(!c->head->delayed) {
+        c->head->delayed = 1;
+        c->throttled++;
+        throttled++;
+    }
+    return 0;
+}
+
+static void refill(client_state *c, struct timespec *now)
+{
+    c->tokens += seconds_between(&c->refilled, now) * limits.rate;
+    if(c->tokens > limits.burst)
+        c->tokens = limits.burst;
+    c->refilled = *now;
+}
+
+static client_state *find_client(struct in_addr addr, int create)
+{
+    unsigned int bucket = (addr.s_addr * 2654435761U) % SCHED_HASH_SIZE;
+    client_state *c;
+
+    for(c = table[bucket]; c; c = c->hash_next) {
+        if(c->addr.s_addr == addr.s_addr)
+            return c;
+    }
+    if(!create)
+        return NULL;
+
+    c = (client_state*)Calloc(1, sizeof(client_state));
+    c->addr = addr;
+    c->tokens = limits.burst;
+    clock_gettime(CLOCK_MONOTONIC, &c->refilled);
+    c->hash_next = table[bucket];
+    table[bucket] = c;
+    clients++;
+    return c;
+}
+
+/*Add a client to the round-robin ring just before the cursor (end of the lap)*/
+static void rr_insert(client_state *c)
+{
+    if(rr_cursor == NULL) {
+        c->rr_next = c->rr_prev = c;
+        rr_cursor = c;
+        return;
+    }
+    c->rr_next = rr_cursor;
+    c->rr_prev = rr_cursor->rr_prev;
+    rr_cursor->rr_prev->rr_next = c;
+    rr_cursor->rr_prev = c;
+}
+
+static void rr_remove(client_state *c)
+{
+    if(c->rr_next == c) {
+        rr_cursor = NULL;
+    } else {
+        c->rr_prev->rr_next = c->rr_next;
+        c->rr_next->rr_prev = c->rr_prev;
+        if(rr_cursor == c)
+            rr_cursor = c->rr_next;
+    }
+    c->rr_next = c->rr_prev = NULL;
+}
+
+/*Forget clients with nothing queued or running and a full bucket again*/
+static void sweep_idle(struct timespec *now)
+{
+    client_state **link, *c;
+    int i;
+
+    for(i = 0; i < SCHED_HASH_SIZE; i++) {
+        link = &table[i];
+        while((c = *link) != NULL) {
+            if(limits.rate > 0)
+                refill(c, now);
+            if(c->queued == 0 && c->active == 0 && c->tokens >= limits.burst) {
+                *link = c->hash_next;
+                free(c);
+                clients--;
+            } else {
+                link = &c->hash_next;
+            }
+        }
+    }
+}
+
+static double seconds_between(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
@@ -0,0 +1,29 @@
+#include "csapp.h"
+
+/* Buckets of the client table, and how often idle clients are swept */
+#define SCHED_HASH_SIZE 1024
+#define SCHED_SWEEP_INTERVAL 1024
+
+/* A connection waiting for a worker */
+typedef struct sched_conn {
+    int fd;
+    struct in_addr client;
+    int delayed;            /* already counted as throttled */
+    struct sched_conn *next;
+} sched_conn;
+
+/* Limits applied to every client IP; 0 means unlimited */
+typedef struct sched_limits {
+    double rate;            /* requests per second */
+    int burst;              /* token bucket depth */
+    int max_queued;         /* connections waiting for a worker */
+    int max_active;         /* connections being served at once */
+} sched_limits;
+
+/*Function prototypes*/
+void sched_init(sched_limits *limits);
+int sched_submit(int fd, struct in_addr client);
+void sched_next(sched_conn *conn);
+void sched_done(struct in_addr client);
+void sched_exempt(struct in_addr client);
+void sched_dump_stats(FILE *fp);
@@ -0,0 +1,206 @@
+/*
+ * Name: Chih-Feng Lin
+         Chi-Heng Wu
+ * Andrew ID: chihfenl
+              chihengw
+
+ *
+ * timer.c - hierarchical timer wheel for connection deadlines. Level 0 has
+ *           one slot per TIMER_TICK_MS tick; every higher level has slots
+ *           covering a full turn of the level below, and its timers are
+ *           cascaded down as the lower level wraps. Arming and cancelling
+ *           are O(1) list operations under one mutex. A ticker thread
+ *           advances the wheel and fires due timers by shutting down their
+ *           socket; firing happens under the same mutex, so once
+ *           timer_cancel returns the socket can be closed safely.
+ */
+
+#include "timer.h"
+
+#define L0_SIZE (1 << TIMER_L0_BITS)
+#define LN_SIZE (1 << TIMER_LN_BITS)
+
+/*Global variables*/
+static conn_timer *level0[L0_SIZE];
+static conn_timer *levels[TIMER_LEVELS - 1][LN_SIZE];
+static unsigned long current_tick;
+static struct timespec epoch;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *ticker_thread(void *vargp);
+static void enqueue(conn_timer *t);
+static void unlink_timer(conn_timer *t);
+static void cascade(int level);
+static unsigned long now_tick(void);
+
+void timer_init(void)
+{
+    pthread_t tid;
+
+    clock_gettime(CLOCK_MONOTONIC, &epoch);
+    Pthread_create(&tid, NULL, ticker_thread, NULL);
+    Pthread_detach(tid);
+}
+
+/*
+ * timer_arm - (Re)start t so that fd is shut down ms milliseconds from now.
+ *             ms <= 0 just cancels it.
+ */
+void timer_arm(conn_timer *t, int fd, int ms)
+{
+    pthread_mutex_lock(&lock);
+    if(t->armed)
+        unlink_timer(t);
+    t->fired = 0;
+    if(ms > 0) {
+        t->fd = fd;
+        t->expires = now_tick() + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+        if(t->expires <= current_tick)
+            t->expires = current_tick + 1;
+        enqueue(t);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void timer_cancel(conn_timer *t)
+{
+    pthread_mutex_lock(&lock);
+    if(t->armed)
+        unlink_timer(t);
+    pthread_mutex_unlock(&lock);
+}
+
+/*Did the deadline pass since t was last armed?*/
+int timer_fired(conn_timer *t)
+{
+    int fired;
+
+    pthread_mutex_lock(&lock);
+    fired = t->fired;
+    pthread_mutex_unlock(&lock);
+    return fired;
+}
+
+/*Put t in the slot of the lowest level whose range covers its expiry*/
+static void enqueue(conn_timer *t)
+{
+    unsigned long delta = t->expires - current_tick;
+    unsigned long idx;
+    conn_timer **slot;
+    int level, shift = TIMER_L0_BITS;
+
+    if(delta < L0_SIZE) {
+        slot = &level0[t->expires & (L0_SIZE - 1)];
+    } else {
+        for(level = 0; level < TIMER_LEVELS - 2; level++) {
+            if(delta < (1UL << (shift + TIMER_LN_BITS)))
+                break;
+            shift += TIMER_LN_BITS;
+        }
+        /*Clamp deadlines beyond the top level to its range*/
+        if(delta >= (1UL << (shift + TIMER_LN_BITS)))
+            t->expires = current_tick + (1UL << (shift + TIMER_LN_BITS)) - 1;
+        idx = (t->expires >> shift) & (LN_SIZE - 1);
+        slot = &levels[level][idx];
+    }
+
+    t->prev = NULL;
+    t->next = *slot;
+    if(*slot)
+        (*slot)->prev = t;
+    *slot = t;
+    t->armed = 1;
+}
+
+static void unlink_timer(conn_timer *t)
+{
+    unsigned long delta;
+    int level, shift;
+
+    if(t->prev) {
+        t->prev->next = t->next;
+    } else {
+        /*Head of its slot: find which slot list points at it*/
+        if(level0[t->expires & (L0_SIZE - 1)] == t) {
+            level0[t->expires & (L0_SIZE - 1)] = t->next;
+        } else {
+            for(level = 0, shift = TIMER_L0_BITS; level < TIMER_LEVELS - 1;
+                    level++, shift += TIMER_LN_BITS) {
+                delta = (t->expires >> shift) & (LN_SIZE - 1);
+                if(levels[level][delta] == t) {
+                    levels[level][delta] = t->next;
+                    break;
+                }
+            }
+        }
+    }
+    if(t->next)
+        t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+    t->armed = 0;
+}
+
+/*Re-file every timer of the current slot of a higher level one level down*/
+static void cascade(int level)
+{
+    int shift = TIMER_L0_BITS + level * TIMER_LN_BITS;
+    unsigned long idx = (current_tick >> shift) & (LN_SIZE - 1);
+    conn_timer *t, *next;
+
+    t = levels[level][idx];
+    levels[level][idx] = NULL;
+
+    /*That slot may itself need refilling from above when it wraps too*/
+    if(idx == 0 && level + 1 < TIMER_LEVELS - 1)
+        cascade(level + 1);
+
+    for(; t; t = next) {
+        next = t->next;
+        t->armed = 0;
+        enqueue(t);
+    }
+}
+
+/*
+ * ticker_thread - Catch the wheel up with the clock every tick, cascading
+ *                 higher levels as level 0 wraps and firing due timers
+ */
+static void *ticker_thread(void *vargp)
+{
+    struct timespec pause = {0, TIMER_TICK_MS * 1000000L};
+    conn_timer *t, *next;
+    unsigned long target;
+
+    while(1) {
+        nanosleep(&pause, NULL);
+
+        pthread_mutex_lock(&lock);
+        target = now_tick();
+        while(current_tick < target) {
+            current_tick++;
+            if((current_tick & (L0_SIZE - 1)) == 0)
+                cascade(0);
+
+            t = level0[current_tick & (L0_SIZE - 1)];
+            level0[current_tick & (L0_SIZE - 1)] = NULL;
+            for(; t; t = next) {
+                next = t->next;
+                t->next = t->prev = NULL;
+                t->armed = 0;
+                t->fired = 1;
+                shutdown(t->fd, SHUT_RDWR);
+            }
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+static unsigned long now_tick(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - epoch.tv_sec) * 1000L +
+            (now.tv_nsec - epoch.tv_nsec) / 1000000L) / TIMER_TICK_MS;
+}
@@ -0,0 +1,25 @@
+#include "csapp.h"
+
+/* Wheel resolution, and slots per level (level 0 is finest) */
+#define TIMER_TICK_MS 10
+#define TIMER_LEVELS 4
+#define TIMER_L0_BITS 8
+#define TIMER_LN_BITS 6
+
+/*
+ * A deadline on one socket. When it passes, the socket is shut down, which
+ * makes any read, write or connect blocked on it return with an error.
+ */
+typedef struct conn_timer {
+    struct conn_timer *next, *prev;
+    unsigned long expires;      /* wheel tick at which it fires */
+    int fd;
+    int armed;
+    int fired;
+} conn_timer;
+
+/*Function prototypes*/
+void timer_init(void);
+void timer_arm(conn_timer *t, int fd, int ms);
+void timer_cancel(conn_timer *t);
+int timer_fired(conn_timer *t);
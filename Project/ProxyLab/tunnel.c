@@ -0,0 +1,161 @@
+/*
+ * Name: Chih-Feng Lin
+         Chi-Heng Wu
+ * Andrew ID: chihfenl
+              chihengw
+
+ *
+ * tunnel.c - byte relay for CONNECT tunnels. Once the tunnel is set up the
+ *            proxy never looks at the payload again, so each direction is
+ *            moved socket -> pipe -> socket with splice() and the bytes stay
+ *            inside the kernel.
+ */
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include "tunnel.h"
+
+typedef struct tunnel_dir {
+    int from;            /* socket we read from */
+    int to;              /* socket we write to */
+    int pipefd[2];       /* kernel buffer between the two */
+    size_t pending;      /* bytes sitting in the pipe */
+    size_t moved;        /* bytes delivered to the sink */
+    int eof;             /* reader saw EOF */
+    int done;            /* EOF seen and pipe drained, write side shut down */
+} tunnel_dir;
+
+static int dir_init(tunnel_dir *dir, int from, int to);
+static int dir_fill(tunnel_dir *dir);
+static int dir_drain(tunnel_dir *dir);
+static void set_nonblocking(int fd);
+
+/*
+ * tunnel_relay - relay bytes in both directions until both sides have
+ *                closed or an error occurs. Anything the client already
+ *                sent that is sitting in client_rio is forwarded first.
+ *                A tunnel idle for idle_ms (if > 0) is given up on.
+ *                Returns the number of bytes moved, or -1 on setup error.
+ */
+ssize_t tunnel_relay(int client_fd, rio_t *client_rio, int server_fd, int idle_ms)
+{
+    tunnel_dir dirs[2];
+    struct pollfd pfds[4];
+    int i, nfds, ready, failed = 0;
+    ssize_t total = 0;
+
+    /*Flush bytes that were read ahead together with the CONNECT header*/
+    if(client_rio->rio_cnt > 0) {
+        if(rio_writen(server_fd, client_rio->rio_bufptr, client_rio->rio_cnt) < 0)
+            return -1;
+        total += client_rio->rio_cnt;
+        client_rio->rio_cnt = 0;
+    }
+
+    if(dir_init(&dirs[0], client_fd, server_fd) < 0)
+        return -1;
+    if(dir_init(&dirs[1], server_fd, client_fd) < 0) {
+        close(dirs[0].pipefd[0]);
+        close(dirs[0].pipefd[1]);
+        return -1;
+    }
+    set_nonblocking(client_fd);
+    set_nonblocking(server_fd);
+
+    while(!failed && !(dirs[0].done && dirs[1].done)) {
+        /*Wait for a readable source or, when the pipe holds data, a writable sink*/
+        nfds = 0;
+        for(i = 0; i < 2; i++) {
+            if(!dirs[i].eof && dirs[i].pending < TUNNEL_PIPE_SIZE) {
+                pfds[nfds].fd = dirs[i].from;
+                pfds[nfds++].events = POLLIN;
+            }
+            if(dirs[i].pending > 0) {
+                pfds[nfds].fd = dirs[i].to;
+                pfds[nfds++].events = POLLOUT;
+            }
+        }
+        if((ready = poll(pfds, nfds, idle_ms > 0 ? idle_ms : -1)) < 0) {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        if(ready == 0)
+            break;
+
+        for(i = 0; i < 2 && !failed; i++) {
+            if(dir_fill(&dirs[i]) < 0 || dir_drain(&dirs[i]) < 0)
+                failed = 1;
+        }
+    }
+
+    for(i = 0; i < 2; i++) {
+        total += dirs[i].moved;
+        close(dirs[i].pipefd[0]);
+        close(dirs[i].pipefd[1]);
+    }
+    return total;
+}
+
+static int dir_init(tunnel_dir *dir, int from, int to)
+{
+    dir->from = from;
+    dir->to = to;
+    dir->pending = 0;
+    dir->moved = 0;
+    dir->eof = 0;
+    dir->done = 0;
+    if(pipe2(dir->pipefd, O_NONBLOCK) < 0)
+        return -1;
+    fcntl(dir->pipefd[1], F_SETPIPE_SZ, TUNNEL_PIPE_SIZE);
+    return 0;
+}
+
+/*Move whatever the source socket has into the pipe*/
+static int dir_fill(tunnel_dir *dir)
+{
+    ssize_t n;
+
+    if(dir->eof || dir->pending >= TUNNEL_PIPE_SIZE)
+        return 0;
+
+    n = splice(dir->from, NULL, dir->pipefd[1], NULL,
+               TUNNEL_PIPE_SIZE - dir->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(n > 0)
+        dir->pending += n;
+    else if(n == 0)
+        dir->eof = 1;
+    else if(errno != EAGAIN && errno != EINTR)
+        return -1;
+    return 0;
+}
+
+/*Move the pipe contents into the sink socket, half-closing it after EOF*/
+static int dir_drain(tunnel_dir *dir)
+{
+    ssize_t n;
+
+    if(dir->pending > 0) {
+        n = splice(dir->pipefd[0], NULL, dir->to, NULL,
+                   dir->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n > 0) {
+            dir->pending -= n;
+            dir->moved += n;
+        }
+        else if(n < 0 && errno != EAGAIN && errno != EINTR)
+            return -1;
+    }
+
+    if(dir->eof && dir->pending == 0 && !dir->done) {
+        shutdown(dir->to, SHUT_WR);
+        dir->done = 1;
+    }
+    return 0;
+}
+
+static void set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags >= 0)
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
@@ -0,0 +1,7 @@
+#include "csapp.h"
+
+/* Bytes each direction may have in flight inside its kernel pipe */
+#define TUNNEL_PIPE_SIZE 65536
+
+/*Function prototypes*/
+ssize_t tunnel_relay(int client_fd, rio_t *client_rio, int server_fd, int idle_ms);
@@ -0,0 +1,196 @@
+/*
+ * Name: Chih-Feng Lin
+         Chi-Heng Wu
+ * Andrew ID: chihfenl
+              chihengw
+
+ *
+ * urlnorm.c - cache key canonicalisation. Equivalent spellings of a URL
+ *             should share one cache entry, so after parse_request_url the
+ *             host is case-folded and the path and query are rewritten into
+ *             a canonical form used as the cache key. The default port needs
+ *             no work here, since "host" and "host:80" already parse to the
+ *             same port number. A rule file can additionally ask for query
+ *             parameters to be sorted and name parameters to strip:
+ *
+ *                 # comment
+ *                 sort-query
+ *                 strip utm_*
+ *                 strip fbclid
+ */
+
+#include <fnmatch.h>
+#include "urlnorm.h"
+
+/*Global variables*/
+static int sort_query;
+static char *strip_patterns[URLNORM_MAX_RULES];
+static int strip_count;
+
+static void normalize_escapes(char *dst, const char *src, size_t len);
+static int is_unreserved(int c);
+static int hex_value(int c);
+static int strip_param(const char *param);
+static int cmp_param(const void *a, const void *b);
+
+/*
+ * urlnorm_load_rules - Read the rule file. Returns -1 if it cannot be read
+ *                      or has an unknown directive.
+ */
+int urlnorm_load_rules(char *path)
+{
+    FILE *fp;
+    char line[MAXLINE], directive[MAXLINE], arg[MAXLINE];
+    int n, lineno = 0;
+
+    if((fp = fopen(path, "r")) == NULL)
+        return -1;
+
+    while(fgets(line, MAXLINE, fp) != NULL) {
+        lineno++;
+        if(line[0] == '#')
+            continue;
+        n = sscanf(line, "%s %s", directive, arg);
+        if(n <= 0)
+            continue;
+
+        if(!strcmp(directive, "sort-query") && n == 1) {
+            sort_query = 1;
+        } else if(!strcmp(directive, "strip") && n == 2 && strip_count < URLNORM_MAX_RULES) {
+            strip_patterns[strip_count++] = strdup(arg);
+        } else {
+            fprintf(stderr, "%s:%d: bad rule: %s", path, lineno, line);
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+/*
+ * urlnorm_canonicalize - Case-fold hostname in place and write the canonical
+ *                        form of uri to key_uri (at most MAXLINE bytes):
+ *                        fragment dropped, percent-escapes of unreserved
+ *                        characters decoded and the rest upper-cased, and
+ *                        the query filtered and sorted as the rules say.
+ *                        A query with more than URLNORM_MAX_PARAMS
+ *                        parameters, or one whose canonical form would not
+ *                        fit, keys on uri exactly as given instead, so no
+ *                        parameter is ever dropped from the key.
+ */
+void urlnorm_canonicalize(char *hostname, char *uri, char *key_uri)
+{
+    char query[MAXLINE];
+    char *params[URLNORM_MAX_PARAMS];
+    char *query_ptr, *end, *param;
+    int i, count = 0;
+    size_t len;
+
+    /*Host names are case-insensitive, and a trailing dot is the same host*/
+    for(i = 0; hostname[i]; i++) {
+        hostname[i] = tolower((unsigned char)hostname[i]);
+    }
+    if(i > 1 && hostname[i - 1] == '.')
+        hostname[i - 1] = '\0';
+
+    /*The fragment never reaches the server*/
+    end = strchr(uri, '#');
+    len = end ? (size_t)(end - uri) : strlen(uri);
+
+    /*Path*/
+    query_ptr = memchr(uri, '?', len);
+    normalize_escapes(key_uri, uri, query_ptr ? (size_t)(query_ptr - uri) : len);
+    if(key_uri[0] == '\0')
+        strcpy(key_uri, "/");
+    if(query_ptr == NULL)
+        return;
+
+    /*Query: split into parameters, drop stripped ones, optionally sort*/
+    query_ptr++;
+    normalize_escapes(query, query_ptr, len - (query_ptr - uri));
+    for(param = strtok_r(query, "&", &end); param; param = strtok_r(NULL, "&", &end)) {
+        if(strip_param(param))
+            continue;
+        if(count == URLNORM_MAX_PARAMS) {
+            strcpy(key_uri, uri);
+            return;
+        }
+        params[count++] = param;
+    }
+    if(sort_query)
+        qsort(params, count, sizeof(char*), cmp_param);
+
+    len = strlen(key_uri);
+    for(i = 0; i < count; i++) {
+        len += snprintf(key_uri + len, MAXLINE - len, "%c%s", i ? '&' : '?', params[i]);
+        if(len >= MAXLINE) {
+            strcpy(key_uri, uri);
+            return;
+        }
+    }
+}
+
+/*Copy len bytes of src to dst, canonicalising percent-escapes*/
+static void normalize_escapes(char *dst, const char *src, size_t len)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    size_t i;
+    int hi, lo, c;
+
+    for(i = 0; i < len; i++) {
+        if(src[i] == '%' && i + 2 < len && (hi = hex_value(src[i + 1])) >= 0 &&
+                (lo = hex_value(src[i + 2])) >= 0) {
+            c = hi * 16 + lo;
+            if(is_unreserved(c)) {
+                *dst++ = c;
+            } else {
+                *dst++ = '%';
+                *dst++ = hex[hi];
+                *dst++ = hex[lo];
+            }
+            i += 2;
+        } else {
+            *dst++ = src[i];
+        }
+    }
+    *dst = '\0';
+}
+
+/*RFC 3986 unreserved characters, which never need escaping*/
+static int is_unreserved(int c)
+{
+    return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+static int hex_value(int c)
+{
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*Does the parameter's name match one of the strip patterns?*/
+static int strip_param(const char *param)
+{
+    char name[MAXLINE];
+    size_t len = strcspn(param, "=");
+    int i;
+
+    memcpy(name, param, len);
+    name[len] = '\0';
+    for(i = 0; i < strip_count; i++) {
+        if(fnmatch(strip_patterns[i], name, 0) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int cmp_param(const void *a, const void *b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
@@ -0,0 +1,9 @@
+#include "csapp.h"
+
+/* Limits on the rule file and on the query strings we rewrite */
+#define URLNORM_MAX_RULES 64
+#define URLNORM_MAX_PARAMS 128
+
+/*Function prototypes*/
+int urlnorm_load_rules(char *path);
+void urlnorm_canonicalize(char *hostname, char *uri, char *key_uri);
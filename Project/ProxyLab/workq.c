@@ -0,0 +1,77 @@
+/*
+ * Name: Chih-Feng Lin
+         Chi-Heng Wu
+ * Andrew ID: chihfenl
+              chihengw
+
+ *
+ * workq.c - bounded FIFO job queue between pools of worker threads. Pushing
+ *           never blocks: a full queue refuses the job, so a producer that
+ *           must stay responsive is never held up by a slow consumer pool.
+ */
+
+#include "workq.h"
+
+void workq_init(workq *q, char *name, int max_depth)
+{
+    memset(q, 0, sizeof(*q));
+    strncpy(q->name, name, sizeof(q->name) - 1);
+    q->max_depth = max_depth;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->ready, NULL);
+}
+
+/*
+ * workq_push - Append item. Returns -1, leaving item to the caller, if the
+ *              queue already holds max_depth jobs.
+ */
+int workq_push(workq *q, workq_item *item)
+{
+    pthread_mutex_lock(&q->lock);
+    if(q->max_depth > 0 && q->depth >= q->max_depth) {
+        q->rejected++;
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+
+    item->next = NULL;
+    if(q->tail)
+        q->tail->next = item;
+    else
+        q->head = item;
+    q->tail = item;
+    q->pushed++;
+    if(++q->depth > q->peak_depth)
+        q->peak_depth = q->depth;
+
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/*workq_pop - Wait for the oldest job and take it*/
+workq_item *workq_pop(workq *q)
+{
+    workq_item *item;
+
+    pthread_mutex_lock(&q->lock);
+    while(q->head == NULL)
+        pthread_cond_wait(&q->ready, &q->lock);
+
+    item = q->head;
+    q->head = item->next;
+    if(q->head == NULL)
+        q->tail = NULL;
+    q->depth--;
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+void workq_dump_stats(workq *q, FILE *fp)
+{
+    pthread_mutex_lock(&q->lock);
+    fprintf(fp, "%s: depth=%d peak=%d pushed=%lu rejected=%lu\n",
+            q->name, q->depth, q->peak_depth, q->pushed, q->rejected);
+    pthread_mutex_unlock(&q->lock);
+    fflush(fp);
+}
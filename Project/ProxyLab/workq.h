@@ -0,0 +1,24 @@
+#include "csapp.h"
+
+/* A queued job; the owner embeds this at the start of its job struct */
+typedef struct workq_item {
+    struct workq_item *next;
+} workq_item;
+
+/* Bounded FIFO feeding one pool of workers */
+typedef struct workq {
+    char name[32];
+    workq_item *head, *tail;
+    int depth;
+    int max_depth;          /* 0 means unbounded */
+    int peak_depth;
+    unsigned long pushed, rejected;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} workq;
+
+/*Function prototypes*/
+void workq_init(workq *q, char *name, int max_depth);
+int workq_push(workq *q, workq_item *item);
+workq_item *workq_pop(workq *q);
+void workq_dump_stats(workq *q, FILE *fp);